@@ -5,54 +5,123 @@
 #include <vector>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <functional>
+#include <stdexcept>
 #include <stdio.h>
 #include <assert.h>
 
 void runtimeError ( const char * msg, ... );
 
+/// A syntax or runtime error, thrown instead of terminating the process while a ThrowErrors
+/// exists on the current thread.
+struct CalcError : public std::runtime_error
+{
+    explicit CalcError ( const std::string & message ) : std::runtime_error( message ) { }
+};
+
+/// Makes the errors of the current thread throw CalcError for as long as it exists.
+struct ThrowErrors
+{
+    ThrowErrors ();
+    ~ThrowErrors ();
+};
+
+/// Report a runtime error if the running task (see scheduler.h) is close to the end of its stack.
+void checkTaskStack ();
+
 struct Function;
+struct FunctionCall;
+struct AstVisitor;
+
+/// A contiguous array of values, the only aggregate type of the language.
+struct Array
+{
+    std::vector<long> data;
+
+    Array(size_t size) : data(size) { }
+};
+typedef std::shared_ptr<Array> ArrayPtr;
 
 struct Env
 {
     Env * const parent;
     std::map<std::string,long> vars;
     std::map<std::string,Function*> funcs;
+    std::map<std::string,ArrayPtr> arrays;
+    /// Variables bound to memory of the host application (see calc.h).
+    std::map<std::string,long*> refs;
+    /// Values of the common subexpressions of the program running in this scope.
+    std::vector<long> temps;
 
     Env(Env *const parent) : parent(parent) { }
 
-    long getVar ( const std::string name )
+    // The lookups walk the scopes in a loop, since a deep recursion can be close to the end of
+    // the stack of a task.
+    long getVar ( const std::string & name )
     {
-        auto it = vars.find( name );
-        if (it != vars.end())
-            return it->second;
-        if (parent)
-            return parent->getVar(name);
+        for ( Env * e = this; e; e = e->parent ) {
+            auto it = e->vars.find( name );
+            if (it != e->vars.end())
+                return it->second;
+            if (!e->refs.empty()) {
+                auto r = e->refs.find( name );
+                if (r != e->refs.end())
+                    return *r->second;
+            }
+        }
         runtimeError( "Undefined variable %s", name.c_str() );
         return 0;
     }
 
-    Function * getFunc ( const std::string name )
+    Function * getFunc ( const std::string & name )
     {
-        auto it = funcs.find( name );
-        if (it != funcs.end())
-            return it->second;
-        if (parent)
-            return parent->getFunc(name);
+        for ( Env * e = this; e; e = e->parent ) {
+            auto it = e->funcs.find( name );
+            if (it != e->funcs.end())
+                return it->second;
+        }
         runtimeError( "Undefined function %s", name.c_str() );
         return 0;
     }
+
+    /// Look up an array, returning NULL if it doesn't exist.
+    Array * findArray ( const std::string & name )
+    {
+        for ( Env * e = this; e; e = e->parent ) {
+            auto it = e->arrays.find( name );
+            if (it != e->arrays.end())
+                return it->second.get();
+        }
+        return NULL;
+    }
+
+    Array * getArray ( const std::string & name )
+    {
+        Array * a = findArray( name );
+        if (!a)
+            runtimeError( "Undefined array %s", name.c_str() );
+        return a;
+    }
 };
 
 #define AST_CODES \
   _ACODE(Number) \
   _ACODE(Ident) \
+  _ACODE(Index) \
   _ACODE(FunctionCall) \
   _ACODE(Expr) \
   _ACODE(BinOp) \
+  _ACODE(CseDef) \
+  _ACODE(CseRef) \
+  _ACODE(Local) \
+  _ACODE(AssignLocal) \
+  _ACODE(InlinedCall) \
   _ACODE(Return) \
   _ACODE(If) \
   _ACODE(While) \
   _ACODE(Assign) \
+  _ACODE(AssignIndex) \
   _ACODE(Block) \
   _ACODE(Function) \
   _ACODE(Program) \
@@ -79,9 +148,11 @@ struct Ast
 {
     const AstCode::T code;
     Ast(AstCode::T code) : code(code) { }
+    virtual ~Ast() { }
 
     virtual void print ( int indent ) = 0;
     virtual long eval ( Env & env ) = 0;
+    virtual void accept ( AstVisitor & v ) = 0;
 };
 typedef std::shared_ptr<Ast> AstPtr;
 
@@ -110,11 +181,14 @@ struct Number : public Atom
     {
         return value;
     }
+    virtual void accept ( AstVisitor & v );
 };
 
 struct Ident : public Atom
 {
     const std::string name;
+    /// If not NULL, the variable is bound to this host memory (only at the top level).
+    long * ref = NULL;
     Ident(const std::string &name) : Atom(AstCode::Ident), name(name) { }
 
     virtual void print ( int indent )
@@ -124,16 +198,64 @@ struct Ident : public Atom
     }
     virtual long eval ( Env & env )
     {
-        return env.getVar( name );
+        return ref ? *ref : env.getVar( name );
     }
+    virtual void accept ( AstVisitor & v );
 };
 
+/// Read an array element: name[index]
+struct Index : public Atom
+{
+    const std::string name;
+    Expr * index;
+
+    Index(const std::string &name, Expr *const index) : Atom(AstCode::Index), name(name), index(index) { }
+    ~Index() { delete index; }
+
+    virtual void print ( int indent )
+    {
+        printIndent(indent);
+        printf( "Index: %s\n", name.c_str() );
+        index->print( indent + INDENT_STEP );
+    }
+    virtual long eval ( Env & env )
+    {
+        // The index may re-create the array, so look it up afterwards
+        long i = index->eval( env );
+        Array * a = env.getArray( name );
+        if (i < 0 || i >= (long)a->data.size())
+            runtimeError( "Index %ld out of range for array %s", i, name.c_str() );
+        return a->data[i];
+    }
+    virtual void accept ( AstVisitor & v );
+};
+
+// Parallel evaluation of calls (see parallel.h).
+struct FutureFrame;
+
+/// Starts the futures of the calls marked for parallel evaluation in a group of operands, and
+/// waits for all of them to complete when the group has been evaluated.
+struct FutureScope
+{
+    FutureFrame * const frame;
+
+    FutureScope ( Env & env, const std::vector<FunctionCall *> & calls );
+    ~FutureScope ();
+};
+
+/// If \p call has been started as a future in \p env, wait for it and store its value in
+/// \p result.
+bool joinFuture ( FunctionCall * call, Env & env, long & result );
+
 struct BinOp : public Expr
 {
-    Expr * const left;
-    Expr * const right;
+    Expr * left;
+    Expr * right;
+    /// Calls among the operands which are started in parallel when this node is evaluated.
+    std::vector<FunctionCall *> parallelCalls;
 
     BinOp(const AstCode::T &code, Expr *const left, Expr *const right) : Expr(code), left(left), right(right) { }
+    ~BinOp() { delete left; delete right; }
 
     virtual void print ( int indent )
     {
@@ -144,6 +266,15 @@ struct BinOp : public Expr
     }
 
     virtual long eval ( Env & env )
+    {
+        if (!parallelCalls.empty()) {
+            FutureScope scope( env, parallelCalls );
+            return evalOperands( env );
+        }
+        return evalOperands( env );
+    }
+
+    long evalOperands ( Env & env )
     {
         long l = left->eval( env );
         long r = right->eval( env );
@@ -159,14 +290,76 @@ struct BinOp : public Expr
             case AstCode::NE: return l != r;
         }
         assert( false );
+        return 0;
+    }
+    virtual void accept ( AstVisitor & v );
+};
+
+/// The first evaluation of a common subexpression, which saves its value in a temporary.
+struct CseDef : public Expr
+{
+    const unsigned slot;
+    const ExprPtr expr;
+
+    CseDef(unsigned slot, const ExprPtr & expr) : Expr(AstCode::CseDef), slot(slot), expr(expr) { }
+
+    virtual void print ( int indent )
+    {
+        printIndent(indent);
+        printf( "CseDef: #%u\n", slot );
+        expr->print( indent + INDENT_STEP );
+    }
+    virtual long eval ( Env & env )
+    {
+        return env.temps[slot] = expr->eval( env );
+    }
+    virtual void accept ( AstVisitor & v );
+};
+
+/// A reuse of the value of a common subexpression.
+struct CseRef : public Expr
+{
+    const unsigned slot;
+
+    CseRef(unsigned slot) : Expr(AstCode::CseRef), slot(slot) { }
+
+    virtual void print ( int indent )
+    {
+        printIndent(indent);
+        printf( "CseRef: #%u\n", slot );
     }
+    virtual long eval ( Env & env )
+    {
+        return env.temps[slot];
+    }
+    virtual void accept ( AstVisitor & v );
+};
+
+/// A variable of an inlined function, kept in a temporary of the caller.
+struct Local : public Expr
+{
+    const unsigned slot;
+
+    Local(unsigned slot) : Expr(AstCode::Local), slot(slot) { }
+
+    virtual void print ( int indent )
+    {
+        printIndent(indent);
+        printf( "Local: #%u\n", slot );
+    }
+    virtual long eval ( Env & env )
+    {
+        return env.temps[slot];
+    }
+    virtual void accept ( AstVisitor & v );
 };
 
 struct Return : public Ast
 {
-    Expr * const value;
+    Expr * value;
 
     Return(Expr *const value) : Ast(AstCode::Return), value(value) { }
+    ~Return() { delete value; }
 
     virtual void print ( int indent )
     {
@@ -179,6 +372,7 @@ struct Return : public Ast
     {
         return value->eval( env );
     }
+    virtual void accept ( AstVisitor & v );
 };
 
 struct Statement : public Ast
@@ -189,9 +383,10 @@ typedef std::shared_ptr<Statement> StatementPtr;
 
 struct StatementExpr : public Statement
 {
-    Expr * const expr;
+    Expr * expr;
 
     StatementExpr(Expr *const expr) : Statement(AstCode::StmtExpr), expr(expr) { }
+    ~StatementExpr() { delete expr; }
 
     virtual void print ( int indent )
     {
@@ -204,16 +399,18 @@ struct StatementExpr : public Statement
     {
         return expr->eval( env );
     }
+    virtual void accept ( AstVisitor & v );
 };
 
 struct If : public Statement
 {
-    Expr * const cond;
+    Expr * cond;
     Statement * const thenClause;
     Statement * const elseClause;
 
     If(Expr *const cond, Statement *const thenClause, Statement *const elseClause) :
        Statement(AstCode::If), cond(cond), thenClause(thenClause), elseClause(elseClause) { }
+    ~If() { delete cond; delete thenClause; delete elseClause; }
 
     virtual void print ( int indent )
     {
@@ -234,15 +431,17 @@ struct If : public Statement
         else
             return 0;
     }
+    virtual void accept ( AstVisitor & v );
 };
 
 struct While : public Statement
 {
-    Expr * const cond;
+    Expr * cond;
     Statement * const body;
 
     While(Expr *const cond, Statement *const body) :
             Statement(AstCode::If), cond(cond), body(body) {}
+    ~While() { delete cond; delete body; }
 
     virtual void print ( int indent )
     {
@@ -259,13 +458,17 @@ struct While : public Statement
             result = body->eval( env );
         return result;
     }
+    virtual void accept ( AstVisitor & v );
 };
 struct Assign : public Statement
 {
     const std::string name;
-    Expr * const value;
+    Expr * value;
+    /// If not NULL, the variable is bound to this host memory (only at the top level).
+    long * ref = NULL;
 
     Assign(const std::string &name, Expr *const value) : Statement(AstCode::Assign), name(name), value(value) { }
+    ~Assign() { delete value; }
 
     virtual void print ( int indent )
     {
@@ -277,9 +480,68 @@ struct Assign : public Statement
     virtual long eval ( Env & env )
     {
         long v = value->eval( env );
-        env.vars[name] = v;
+        if (ref)
+            *ref = v;
+        else
+            env.vars[name] = v;
         return v;
     }
+    virtual void accept ( AstVisitor & v );
+};
+
+/// Assign an array element: name[index] = value
+struct AssignIndex : public Statement
+{
+    const std::string name;
+    Expr * index;
+    Expr * value;
+
+    AssignIndex(const std::string &name, Expr *const index, Expr *const value) :
+            Statement(AstCode::AssignIndex), name(name), index(index), value(value) { }
+    ~AssignIndex() { delete index; delete value; }
+
+    virtual void print ( int indent )
+    {
+        printIndent(indent);
+        printf( "AssignIndex %s\n", name.c_str() );
+        index->print( indent + INDENT_STEP );
+        value->print( indent + INDENT_STEP );
+    }
+
+    virtual long eval ( Env & env )
+    {
+        long i = index->eval( env );
+        long v = value->eval( env );
+        Array * a = env.getArray( name );
+        if (i < 0 || i >= (long)a->data.size())
+            runtimeError( "Index %ld out of range for array %s", i, name.c_str() );
+        a->data[i] = v;
+        return v;
+    }
+    virtual void accept ( AstVisitor & v );
+};
+
+/// Assign a variable of an inlined function
+struct AssignLocal : public Statement
+{
+    const unsigned slot;
+    Expr * value;
+
+    AssignLocal(unsigned slot, Expr *const value) : Statement(AstCode::AssignLocal), slot(slot), value(value) { }
+    ~AssignLocal() { delete value; }
+
+    virtual void print ( int indent )
+    {
+        printIndent(indent);
+        printf( "AssignLocal #%u\n", slot );
+        value->print( indent + INDENT_STEP );
+    }
+
+    virtual long eval ( Env & env )
+    {
+        return env.temps[slot] = value->eval( env );
+    }
+    virtual void accept ( AstVisitor & v );
 };
 
 struct Block : public Statement
@@ -302,15 +564,19 @@ struct Block : public Statement
             result = sp->eval( env );
         return result;
     }
+    virtual void accept ( AstVisitor & v );
 };
 
 struct Program : public Ast
 {
     Block * const body;
     Return * const returnStmt;
+    /// Number of temporaries needed for the common subexpressions.
+    unsigned numTemps = 0;
 
     Program(Block *const body, Return *const returnStmt) :
             Ast(AstCode::Program), body(body), returnStmt(returnStmt) { }
+    ~Program() { delete body; delete returnStmt; }
 
     virtual void print ( int indent )
     {
@@ -322,19 +588,41 @@ struct Program : public Ast
 
     virtual long eval ( Env & env )
     {
+        if (env.temps.size() < numTemps)
+            env.temps.resize( numTemps );
         body->eval( env );
         return returnStmt->eval( env );
     }
+    virtual void accept ( AstVisitor & v );
 };
 
 struct Function : public Statement
 {
     const std::string name;
     std::vector<std::string> params;
-    Program * const body;
+    /// NULL for natives and for lazy functions which haven't been called yet.
+    Program * body;
+    /// Whether the body is created on the first call, parsed from \p bodySource or by
+    /// \p bodyLoader.
+    const bool lazy;
+    /// The source of the body of a lazy function up to the closing brace, and the position
+    /// of the opening brace. Released once the body has been parsed.
+    std::string bodySource;
+    const int bodyLine, bodyCol;
+    /// Creates the body of a lazy function restored from a snapshot.
+    std::function<Program *()> bodyLoader;
+    std::once_flag bodyParsed;
 
     Function ( const std::string & name, std::vector<std::string> && params, Program * body ) :
-        Statement(AstCode::Function), name(name), params(params), body(body) {};
+        Statement(AstCode::Function), name(name), params(params), body(body), lazy(false), bodyLine(0), bodyCol(0) {};
+    Function ( const std::string & name, std::vector<std::string> && params, std::string && bodySource,
+               int bodyLine, int bodyCol ) :
+        Statement(AstCode::Function), name(name), params(params), body(NULL), lazy(true), bodySource(bodySource),
+        bodyLine(bodyLine), bodyCol(bodyCol) {};
+    Function ( const std::string & name, std::vector<std::string> && params, std::function<Program *()> && bodyLoader ) :
+        Statement(AstCode::Function), name(name), params(params), body(NULL), lazy(true), bodyLine(0), bodyCol(0),
+        bodyLoader(bodyLoader) {};
+    ~Function() { delete body; }
 
     virtual void print ( int indent )
     {
@@ -346,7 +634,16 @@ struct Function : public Statement
             printf( "%s", it->c_str() );
         }
         printf( ")\n" );
-        body->print( indent + INDENT_STEP );
+        if (body)
+            body->print( indent + INDENT_STEP );
+        else if (bodyLoader) {
+            printIndent( indent + INDENT_STEP );
+            printf( "Not loaded yet\n" );
+        }
+        else {
+            printIndent( indent + INDENT_STEP );
+            printf( "Not parsed yet (line %d)\n", bodyLine );
+        }
     }
 
     virtual long eval ( Env & env )
@@ -354,10 +651,18 @@ struct Function : public Statement
         env.funcs[name] = this;
         return 0;
     }
+    virtual void accept ( AstVisitor & v );
+
+    /// Parse or load the body of a lazy function if that hasn't happened yet. Safe to call from
+    /// multiple threads.
+    Program * parseBody ();
 
     virtual long call ( Env & env, const std::vector<ExprPtr> & args )
     {
         long result;
+        checkTaskStack();
+        if (lazy)
+            parseBody();
         Env funcEnv( &env );
         for ( int i = 0, e = params.size(); i < e; ++i ) {
            long v = i < args.size() ? args[i]->eval( env ) : 0;
@@ -365,33 +670,251 @@ struct Function : public Statement
         }
         return body->eval( funcEnv );
     }
+
+    /// Whether the arguments of a call may be evaluated as futures. All arguments must be
+    /// evaluated before the body can modify anything, which is not the case for extra arguments.
+    virtual bool acceptsFutures ( size_t argCount )
+    {
+        return argCount <= params.size();
+    }
 };
 
+/// What a native function does besides computing its result.
+struct Effect
+{
+    enum T
+    {
+        None,   ///< nothing, the result depends only on the arguments and the environment
+        Output, ///< produces output, but doesn't modify the environment
+        State,  ///< modifies the environment
+    };
+};
+
+struct NativeFunction : public Function
+{
+    long (* const fn)(Env & env, const std::vector<ExprPtr> & args);
+    const Effect::T effect;
+
+    NativeFunction(const char * name, long (*fn)(Env & env, const std::vector<ExprPtr> & args), Effect::T effect) :
+            Function( name, std::vector<std::string>(), NULL ), fn(fn), effect(effect) {}
+
+    virtual void print ( int indent )
+    {
+        printIndent(indent);
+        printf( "Natuve Function %s (", name.c_str() );
+        for ( auto it = params.begin(); it != params.end(); ++it ) {
+            if (it != params.begin())
+                printf( ", " );
+            printf( "%s", it->c_str() );
+        }
+        printf( ")\n" );
+    }
+
+    virtual long eval ( Env & env )
+    {
+        env.funcs[name] = this;
+        return 0;
+    }
+
+    virtual long call ( Env & env, const std::vector<ExprPtr> & args )
+    {
+        return fn( env, args );
+    }
+
+    /// Natives evaluate their arguments themselves, so they can't have any of them pending
+    /// while they modify the environment.
+    virtual bool acceptsFutures ( size_t )
+    {
+        return effect != Effect::State;
+    }
+};
+
+void registerNativeFunction ( Env & env, const char * name, long (*fn)(Env & env, const std::vector<ExprPtr> & args),
+                              Effect::T effect = Effect::State );
+
 struct FunctionCall : public Atom
 {
     const std::string name;
-    const std::vector<ExprPtr> args;
+    std::vector<ExprPtr> args;
+    /// Set if the call may have been started as a future by the enclosing group of operands.
+    bool async = false;
+    /// Calls among the arguments which are started in parallel when this node is evaluated.
+    std::vector<FunctionCall *> parallelCalls;
+
     FunctionCall ( const std::string & name, std::vector<ExprPtr> && args ) :
             Atom(AstCode::FunctionCall), name(name), args(args) {}
 
     virtual void print ( int indent )
     {
         printIndent(indent);
-        printf( "call %s\n", name.c_str() );
+        printf( "call %s%s\n", name.c_str(), async ? " (parallel)" : "" );
         for ( const auto & a : args )
             a->print( indent + INDENT_STEP );
     }
     virtual long eval ( Env & env )
     {
-        return env.getFunc( name )->call( env, args );
+        long result;
+        if (async && joinFuture( this, env, result ))
+            return result;
+        return evalCall( env );
     }
+
+    long evalCall ( Env & env )
+    {
+        Function * fn = env.getFunc( name );
+        if (!parallelCalls.empty() && fn->acceptsFutures( args.size() )) {
+            FutureScope scope( env, parallelCalls );
+            return fn->call( env, args );
+        }
+        return fn->call( env, args );
+    }
+    virtual void accept ( AstVisitor & v );
 };
 
+/// A call whose callee has been substituted at the call site. The parameters and variables
+/// of the callee live in temporaries of the caller starting at \p firstSlot. If at run time
+/// the name is bound to a different function than the inlined one (because it has been
+/// redefined or shadowed), the original call is performed instead.
+struct InlinedCall : public Expr
+{
+    const std::shared_ptr<FunctionCall> call;
+    Function * const callee;
+    const unsigned firstSlot;
+    std::vector<StatementPtr> body;
+    Expr * result;
+
+    InlinedCall ( const std::shared_ptr<FunctionCall> & call, Function * callee, unsigned firstSlot,
+                  std::vector<StatementPtr> && body, Expr * result ) :
+            Expr(AstCode::InlinedCall), call(call), callee(callee), firstSlot(firstSlot), body(body), result(result) {}
+    ~InlinedCall() { delete result; }
+
+    virtual void print ( int indent )
+    {
+        printIndent(indent);
+        printf( "inlined call %s #%u\n", call->name.c_str(), firstSlot );
+        for ( const auto & a : call->args )
+            a->print( indent + INDENT_STEP );
+        for ( const auto & sp : body )
+            sp->print( indent + INDENT_STEP );
+        result->print( indent + INDENT_STEP );
+    }
+    virtual long eval ( Env & env )
+    {
+        if (env.getFunc( call->name ) != callee)
+            return call->evalCall( env );
+        const auto & args = call->args;
+        for ( size_t i = 0, e = callee->params.size(); i < e; ++i )
+            env.temps[firstSlot + i] = i < args.size() ? args[i]->eval( env ) : 0;
+        for ( const auto & sp : body )
+            sp->eval( env );
+        return result->eval( env );
+    }
+    virtual void accept ( AstVisitor & v );
+};
 
+/// Walks the tree. The default implementation of every method simply visits the children,
+/// so a subclass only needs to override the nodes it is interested in.
 struct AstVisitor
 {
-    virtual void visitNumber ( Number * );
-    virtual void visitIdent ( Ident * );
+    virtual ~AstVisitor() { }
+
+    virtual void visitNumber ( Number * ) { }
+    virtual void visitIdent ( Ident * ) { }
+    virtual void visitIndex ( Index * n )
+    {
+        n->index->accept( *this );
+    }
+    virtual void visitBinOp ( BinOp * n )
+    {
+        n->left->accept( *this );
+        n->right->accept( *this );
+    }
+    virtual void visitCseDef ( CseDef * n )
+    {
+        n->expr->accept( *this );
+    }
+    virtual void visitCseRef ( CseRef * ) { }
+    virtual void visitLocal ( Local * ) { }
+    virtual void visitReturn ( Return * n )
+    {
+        n->value->accept( *this );
+    }
+    virtual void visitStatementExpr ( StatementExpr * n )
+    {
+        n->expr->accept( *this );
+    }
+    virtual void visitIf ( If * n )
+    {
+        n->cond->accept( *this );
+        n->thenClause->accept( *this );
+        if (n->elseClause)
+            n->elseClause->accept( *this );
+    }
+    virtual void visitWhile ( While * n )
+    {
+        n->cond->accept( *this );
+        n->body->accept( *this );
+    }
+    virtual void visitAssign ( Assign * n )
+    {
+        n->value->accept( *this );
+    }
+    virtual void visitAssignIndex ( AssignIndex * n )
+    {
+        n->index->accept( *this );
+        n->value->accept( *this );
+    }
+    virtual void visitAssignLocal ( AssignLocal * n )
+    {
+        n->value->accept( *this );
+    }
+    virtual void visitBlock ( Block * n )
+    {
+        for ( const auto & sp : n->list )
+            sp->accept( *this );
+    }
+    virtual void visitProgram ( Program * n )
+    {
+        n->body->accept( *this );
+        n->returnStmt->accept( *this );
+    }
+    virtual void visitFunction ( Function * n )
+    {
+        if (n->body)
+            n->body->accept( *this );
+    }
+    virtual void visitFunctionCall ( FunctionCall * n )
+    {
+        for ( const auto & a : n->args )
+            a->accept( *this );
+    }
+    virtual void visitInlinedCall ( InlinedCall * n )
+    {
+        n->call->accept( *this );
+        for ( const auto & sp : n->body )
+            sp->accept( *this );
+        n->result->accept( *this );
+    }
 };
 
+inline void Number::accept ( AstVisitor & v ) { v.visitNumber( this ); }
+inline void Ident::accept ( AstVisitor & v ) { v.visitIdent( this ); }
+inline void Index::accept ( AstVisitor & v ) { v.visitIndex( this ); }
+inline void BinOp::accept ( AstVisitor & v ) { v.visitBinOp( this ); }
+inline void CseDef::accept ( AstVisitor & v ) { v.visitCseDef( this ); }
+inline void CseRef::accept ( AstVisitor & v ) { v.visitCseRef( this ); }
+inline void Local::accept ( AstVisitor & v ) { v.visitLocal( this ); }
+inline void Return::accept ( AstVisitor & v ) { v.visitReturn( this ); }
+inline void StatementExpr::accept ( AstVisitor & v ) { v.visitStatementExpr( this ); }
+inline void If::accept ( AstVisitor & v ) { v.visitIf( this ); }
+inline void While::accept ( AstVisitor & v ) { v.visitWhile( this ); }
+inline void Assign::accept ( AstVisitor & v ) { v.visitAssign( this ); }
+inline void AssignIndex::accept ( AstVisitor & v ) { v.visitAssignIndex( this ); }
+inline void AssignLocal::accept ( AstVisitor & v ) { v.visitAssignLocal( this ); }
+inline void Block::accept ( AstVisitor & v ) { v.visitBlock( this ); }
+inline void Program::accept ( AstVisitor & v ) { v.visitProgram( this ); }
+inline void Function::accept ( AstVisitor & v ) { v.visitFunction( this ); }
+inline void FunctionCall::accept ( AstVisitor & v ) { v.visitFunctionCall( this ); }
+inline void InlinedCall::accept ( AstVisitor & v ) { v.visitInlinedCall( this ); }
+
 #endif //CALC_AST_H
@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <string>
+
+#include "calc.h"
+
+extern char ** environ;
+
+/// Measures the cost of evaluating a small script through the library, with its inputs and
+/// output bound to host variables, against running the calc executable for every evaluation
+/// as a service would without the library.
+
+static const char s_source[] =
+    "fn clamp(v) { if (v > limit) v = limit; return v; }\n"
+    "y = clamp(a * x * x + b * x + c);\n"
+    "return y;\n";
+
+static double elapsedSec ( const struct timespec & start )
+{
+    struct timespec end;
+    clock_gettime( CLOCK_MONOTONIC, &end );
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+}
+
+/// Run calc with the script on its standard input and the inputs defined on the command line.
+static void spawnCalc ( const char * scriptPath, long x )
+{
+    std::string defs = "a=3,b=5,c=7,limit=1000000,x=" + std::to_string( x );
+    char * argv[] = { (char *)CALC_PATH, (char *)"-D", (char *)defs.c_str(), NULL };
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init( &actions );
+    posix_spawn_file_actions_addopen( &actions, 0, scriptPath, O_RDONLY, 0 );
+    posix_spawn_file_actions_addopen( &actions, 1, "/dev/null", O_WRONLY, 0 );
+    pid_t pid;
+    if (posix_spawn( &pid, CALC_PATH, &actions, NULL, argv, environ ) != 0) {
+        perror( CALC_PATH );
+        exit( 1 );
+    }
+    posix_spawn_file_actions_destroy( &actions );
+    int status;
+    if (waitpid( pid, &status, 0 ) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf( stderr, "%s failed\n", CALC_PATH );
+        exit( 1 );
+    }
+}
+
+/// Errors must be reported to the application, which can then keep using the script.
+static bool checkErrors ()
+{
+    bool ok = false;
+    try {
+        CalcScript bad( "y = 1;\nreturn y +;\n" );
+    }
+    catch (const CalcError & e) {
+        printf( "syntax error:  %s\n", e.what() );
+        ok = true;
+    }
+
+    long n = 5;
+    CalcScript script( "array(a, 2);\na[1] = 7;\nreturn a[n];\n" );
+    script.bind( "n", &n );
+    try {
+        script.eval();
+        ok = false;
+    }
+    catch (const CalcError & e) {
+        printf( "runtime error: %s\n", e.what() );
+    }
+    n = 1;
+    return ok && script.eval() == 7;
+}
+
+int main ( int argc, char ** argv )
+{
+    long evals = argc > 1 ? atol( argv[1] ) : 1000000;
+    long spawns = argc > 2 ? atol( argv[2] ) : 200;
+
+    if (!checkErrors()) {
+        fprintf( stderr, "Errors not reported\n" );
+        return 1;
+    }
+
+    long a = 3, b = 5, c = 7, limit = 1000000, x = 0, y = 0;
+    CalcScript script( s_source );
+    script.bind( "a", &a );
+    script.bind( "b", &b );
+    script.bind( "c", &c );
+    script.bind( "limit", &limit );
+    script.bind( "x", &x );
+    script.bind( "y", &y );
+
+    struct timespec start;
+    clock_gettime( CLOCK_MONOTONIC, &start );
+    long sum = 0;
+    for ( long i = 0; i < evals; ++i ) {
+        x = i & 1023;
+        sum += script.eval();
+    }
+    double libSec = elapsedSec( start );
+    if (sum == 0 || y != script.eval())
+        fprintf( stderr, "Unexpected result\n" );
+
+    char scriptPath[] = "/tmp/calc_benchXXXXXX";
+    int fd = mkstemp( scriptPath );
+    if (fd < 0 || write( fd, s_source, sizeof(s_source) - 1 ) != (ssize_t)sizeof(s_source) - 1) {
+        perror( scriptPath );
+        return 1;
+    }
+    close( fd );
+
+    clock_gettime( CLOCK_MONOTONIC, &start );
+    for ( long i = 0; i < spawns; ++i )
+        spawnCalc( scriptPath, i & 1023 );
+    double spawnSec = elapsedSec( start );
+    unlink( scriptPath );
+
+    double libUs = libSec * 1e6 / evals, spawnUs = spawnSec * 1e6 / spawns;
+    printf( "library: %ld evaluations, %.3f us each\n", evals, libUs );
+    printf( "spawn:   %ld runs of %s, %.1f us each\n", spawns, CALC_PATH, spawnUs );
+    printf( "ratio:   %.0fx\n", spawnUs / libUs );
+    return 0;
+}
@@ -0,0 +1,57 @@
+#include "calc.h"
+#include "parser.h"
+
+static Program * parseScript ( const char * source )
+{
+    ThrowErrors throwErrors;
+    return parseString( source );
+}
+
+CalcScript::CalcScript ( const char * source ) : m_prog(parseScript( source )), m_globals(NULL)
+{
+    registerBuiltins( m_globals );
+}
+
+CalcScript::~CalcScript ()
+{
+    delete m_prog;
+}
+
+void CalcScript::bind ( const char * name, long * var )
+{
+    struct Binder : public AstVisitor
+    {
+        const std::string name;
+        long * const var;
+        Binder ( const char * name, long * var ) : name(name), var(var) { }
+
+        virtual void visitIdent ( Ident * n )
+        {
+            if (n->name == name)
+                n->ref = var;
+        }
+        virtual void visitAssign ( Assign * n )
+        {
+            if (n->name == name)
+                n->ref = var;
+            AstVisitor::visitAssign( n );
+        }
+        // Within functions the name may refer to a parameter or local variable.
+        virtual void visitFunction ( Function * ) { }
+    } binder( name, var );
+    m_prog->accept( binder );
+    m_globals.refs[name] = var;
+}
+
+void CalcScript::registerNative ( const char * name, long (*fn)(Env & env, const std::vector<ExprPtr> & args),
+                                  Effect::T effect )
+{
+    registerNativeFunction( m_globals, name, fn, effect );
+}
+
+long CalcScript::eval ()
+{
+    ThrowErrors throwErrors;
+    Env env( &m_globals );
+    return m_prog->eval( env );
+}
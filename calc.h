@@ -0,0 +1,46 @@
+#ifndef CALC_CALC_H
+#define CALC_CALC_H
+
+#include "ast.h"
+
+/// A script embedded in a C++ application. It is parsed once and can then be evaluated any
+/// number of times.
+///
+/// Variables of the script can be bound to variables of the application, which the script then
+/// reads and assigns directly. All other variables, and the functions defined by the script,
+/// are created anew by every evaluation. Syntax and runtime errors throw CalcError, after which
+/// the script can be evaluated again. Parsing is not thread safe.
+class CalcScript
+{
+public:
+    /// Parse \p source and register the builtins. Throws CalcError if it has a syntax error.
+    explicit CalcScript ( const char * source );
+    ~CalcScript ();
+
+    /// Bind the variable \p name to \p var, which must outlive the script. At the top level the
+    /// references are resolved once, so reading and assigning the variable costs the same as a
+    /// pointer access. Functions, which can only read it (assignments create local variables),
+    /// find it through the global scope.
+    void bind ( const char * name, long * var );
+
+    /// Define a native function, which may replace a builtin. \p effect tells the optimizations
+    /// what it may do.
+    void registerNative ( const char * name, long (*fn)(Env & env, const std::vector<ExprPtr> & args),
+                          Effect::T effect = Effect::State );
+
+    /// Evaluate the script and return its result. Throws CalcError on a runtime error, or on a
+    /// syntax error in a function parsed lazily (see setLazyParsing()). The bound variables keep
+    /// the values assigned before the error.
+    long eval ();
+
+    Program * program () const { return m_prog; }
+
+private:
+    Program * const m_prog;
+    Env m_globals;
+
+    CalcScript ( const CalcScript & ) = delete;
+    CalcScript & operator = ( const CalcScript & ) = delete;
+};
+
+#endif //CALC_CALC_H
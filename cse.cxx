@@ -0,0 +1,328 @@
+#include "opt.h"
+
+#include <set>
+#include <tuple>
+
+// The program is processed in order of evaluation, giving every expression a value number.
+// Variables get a new value number when they are assigned, and a binary operator gets the
+// value number of an earlier operator with the same operation and operand numbers, if there
+// is one. Such operators are replaced by the value saved by the earlier one.
+//
+// Expressions are only available in the region where they are guaranteed to have been
+// evaluated: the branches of an 'if', the body of a loop and the arguments of a call (which
+// may not all be evaluated) are regions of their own. Since the evaluation of a call can't be
+// followed statically under dynamic scoping, it conservatively clobbers all variables. Array
+// elements are never considered equal.
+
+/// Variables assigned by a statement (not counting nested functions), and whether it calls
+/// anything.
+struct Clobbers : public AstVisitor
+{
+    std::set<std::string> vars;
+    bool call = false;
+
+    virtual void visitAssign ( Assign * n )
+    {
+        vars.insert( n->name );
+        AstVisitor::visitAssign( n );
+    }
+    virtual void visitFunctionCall ( FunctionCall * n )
+    {
+        call = true;
+        AstVisitor::visitFunctionCall( n );
+    }
+    virtual void visitFunction ( Function * ) { }
+};
+
+/// Finds the operators which can reuse the value of an earlier one.
+class CseAnalysis : public AstVisitor
+{
+public:
+    /// Operators which can be replaced, with the earlier operator whose value they reuse
+    std::map<BinOp *, BinOp *> refs;
+    /// Operators whose value is reused
+    std::set<BinOp *> defs;
+
+    virtual void visitNumber ( Number * n )
+    {
+        auto it = m_numbers.find( n->value );
+        m_vn = it != m_numbers.end() ? it->second : (m_numbers[n->value] = fresh());
+    }
+    virtual void visitIdent ( Ident * n )
+    {
+        auto it = m_state.vars.find( n->name );
+        m_vn = it != m_state.vars.end() ? it->second : (m_state.vars[n->name] = fresh());
+    }
+    virtual void visitIndex ( Index * n )
+    {
+        AstVisitor::visitIndex( n );
+        m_vn = fresh();
+    }
+    virtual void visitBinOp ( BinOp * n )
+    {
+        n->left->accept( *this );
+        unsigned l = m_vn;
+        n->right->accept( *this );
+        unsigned r = m_vn;
+
+        Key key( n->code, l, r );
+        auto it = m_state.exprs.find( key );
+        if (it != m_state.exprs.end()) {
+            refs[n] = it->second.node;
+            defs.insert( it->second.node );
+            m_vn = it->second.vn;
+        }
+        else {
+            m_vn = fresh();
+            m_state.exprs[key] = Entry{ m_vn, n };
+        }
+    }
+    virtual void visitCseDef ( CseDef * n )
+    {
+        AstVisitor::visitCseDef( n );
+        m_vn = fresh();
+    }
+    virtual void visitCseRef ( CseRef * )
+    {
+        m_vn = fresh();
+    }
+    virtual void visitFunctionCall ( FunctionCall * n )
+    {
+        for ( const auto & a : n->args ) {
+            State save = m_state;
+            a->accept( *this );
+            m_state = save;
+        }
+        m_state.clear();
+        m_vn = fresh();
+    }
+    /// The inlined body is only evaluated if the callee hasn't changed, so it is a region of
+    /// its own, and otherwise this is a call.
+    virtual void visitInlinedCall ( InlinedCall * n )
+    {
+        n->call->accept( *this );
+    }
+    virtual void visitLocal ( Local * )
+    {
+        m_vn = fresh();
+    }
+
+    virtual void visitAssign ( Assign * n )
+    {
+        AstVisitor::visitAssign( n );
+        m_state.vars[n->name] = fresh();
+    }
+    virtual void visitIf ( If * n )
+    {
+        n->cond->accept( *this );
+
+        Clobbers clobbers;
+        n->thenClause->accept( clobbers );
+        if (n->elseClause)
+            n->elseClause->accept( clobbers );
+
+        State save = m_state;
+        n->thenClause->accept( *this );
+        m_state = save;
+        if (n->elseClause) {
+            n->elseClause->accept( *this );
+            m_state = save;
+        }
+        clobber( clobbers );
+    }
+    /// The condition is evaluated again after every iteration, so it must not reuse anything
+    /// the body may change. It is always evaluated last, so its values remain available after
+    /// the loop.
+    virtual void visitWhile ( While * n )
+    {
+        Clobbers clobbers;
+        n->cond->accept( clobbers );
+        n->body->accept( clobbers );
+        clobber( clobbers );
+
+        n->cond->accept( *this );
+        State save = m_state;
+        n->body->accept( *this );
+        m_state = save;
+    }
+    /// Function bodies are processed separately, with nothing available.
+    virtual void visitFunction ( Function * n )
+    {
+        State save = m_state;
+        m_state.clear();
+        AstVisitor::visitFunction( n );
+        m_state = save;
+    }
+
+private:
+    typedef std::tuple<int, unsigned, unsigned> Key;
+    struct Entry
+    {
+        unsigned vn;
+        BinOp * node;
+    };
+    struct State
+    {
+        std::map<std::string, unsigned> vars;
+        std::map<Key, Entry> exprs;
+
+        void clear ()
+        {
+            vars.clear();
+            exprs.clear();
+        }
+    };
+
+    State m_state;
+    std::map<long, unsigned> m_numbers;
+    unsigned m_nextVN = 0;
+    /// The value number of the last visited expression
+    unsigned m_vn = 0;
+
+    unsigned fresh ()
+    {
+        return m_nextVN++;
+    }
+
+    void clobber ( const Clobbers & clobbers )
+    {
+        if (clobbers.call)
+            m_state.clear();
+        else {
+            for ( const auto & name : clobbers.vars )
+                m_state.vars[name] = fresh();
+        }
+    }
+};
+
+unsigned countNodes ( Ast * node )
+{
+    struct Counter : public AstVisitor
+    {
+        unsigned count = 0;
+
+        virtual void visitNumber ( Number * ) { ++count; }
+        virtual void visitIdent ( Ident * ) { ++count; }
+        virtual void visitIndex ( Index * n ) { ++count; AstVisitor::visitIndex( n ); }
+        virtual void visitBinOp ( BinOp * n ) { ++count; AstVisitor::visitBinOp( n ); }
+        virtual void visitCseDef ( CseDef * n ) { ++count; AstVisitor::visitCseDef( n ); }
+        virtual void visitCseRef ( CseRef * ) { ++count; }
+        virtual void visitLocal ( Local * ) { ++count; }
+        virtual void visitInlinedCall ( InlinedCall * n ) { ++count; AstVisitor::visitInlinedCall( n ); }
+        virtual void visitFunctionCall ( FunctionCall * n ) { ++count; AstVisitor::visitFunctionCall( n ); }
+    } counter;
+    node->accept( counter );
+    return counter.count;
+}
+
+/// Replaces the reused operators with CseDef and the reusing ones with CseRef.
+class CseRewriter : public AstVisitor
+{
+public:
+    CseStats stats;
+
+    CseRewriter ( CseAnalysis & cse ) : m_cse( cse ) { }
+
+    virtual void visitIndex ( Index * n ) { rewrite( n->index ); }
+    virtual void visitBinOp ( BinOp * n )
+    {
+        rewrite( n->left );
+        rewrite( n->right );
+    }
+    virtual void visitFunctionCall ( FunctionCall * n )
+    {
+        for ( auto & a : n->args )
+            rewrite( a );
+    }
+    virtual void visitReturn ( Return * n ) { rewrite( n->value ); }
+    virtual void visitStatementExpr ( StatementExpr * n ) { rewrite( n->expr ); }
+    virtual void visitIf ( If * n )
+    {
+        rewrite( n->cond );
+        n->thenClause->accept( *this );
+        if (n->elseClause)
+            n->elseClause->accept( *this );
+    }
+    virtual void visitWhile ( While * n )
+    {
+        rewrite( n->cond );
+        n->body->accept( *this );
+    }
+    virtual void visitAssign ( Assign * n ) { rewrite( n->value ); }
+    virtual void visitAssignIndex ( AssignIndex * n )
+    {
+        rewrite( n->index );
+        rewrite( n->value );
+    }
+    virtual void visitProgram ( Program * n )
+    {
+        Program * save = m_prog;
+        m_prog = n;
+        AstVisitor::visitProgram( n );
+        m_prog = save;
+    }
+
+private:
+    CseAnalysis & m_cse;
+    Program * m_prog = NULL;
+    std::map<BinOp *, unsigned> m_slots;
+
+    /// If \p e is replaced, return the replacement.
+    Expr * replacement ( Expr * e )
+    {
+        auto it = m_cse.refs.find( dynamic_cast<BinOp *>(e) );
+        if (it == m_cse.refs.end())
+            return NULL;
+        // The earlier operator precedes this one in the order of evaluation, so it has already
+        // been visited
+        assert( m_slots.count( it->second ) );
+        ++stats.reused;
+        stats.eliminatedNodes += countNodes( e ) - 1;
+        return new CseRef( m_slots[it->second] );
+    }
+
+    /// If the value of \p e is reused, allocate its temporary.
+    bool isDef ( Expr * e, unsigned & slot )
+    {
+        BinOp * op = dynamic_cast<BinOp *>(e);
+        if (!op || !m_cse.defs.count( op ))
+            return false;
+        slot = m_slots[op] = m_prog->numTemps++;
+        return true;
+    }
+
+    void rewrite ( Expr * & e )
+    {
+        unsigned slot;
+        if (Expr * r = replacement( e )) {
+            delete e;
+            e = r;
+        }
+        else {
+            e->accept( *this );
+            if (isDef( e, slot ))
+                e = new CseDef( slot, ExprPtr( e ) );
+        }
+    }
+
+    void rewrite ( ExprPtr & e )
+    {
+        unsigned slot;
+        if (Expr * r = replacement( e.get() ))
+            e = ExprPtr( r );
+        else {
+            e->accept( *this );
+            if (isDef( e.get(), slot ))
+                e = ExprPtr( new CseDef( slot, e ) );
+        }
+    }
+};
+
+CseStats eliminateCommonSubexpressions ( Program * prog )
+{
+    CseAnalysis cse;
+    prog->accept( cse );
+    CseRewriter rewriter( cse );
+    prog->accept( rewriter );
+    return rewriter.stats;
+}
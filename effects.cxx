@@ -0,0 +1,169 @@
+#include "effects.h"
+
+/// The cost of a loop body is multiplied by this, since the number of iterations is unknown.
+#define LOOP_COST_FACTOR 100
+
+static unsigned addCost ( unsigned a, unsigned b )
+{
+    return a + b < a ? EffectAnalysis::UNBOUNDED : a + b;
+}
+
+static unsigned mulCost ( unsigned a, unsigned b )
+{
+    return b && a > EffectAnalysis::UNBOUNDED / b ? EffectAnalysis::UNBOUNDED : a * b;
+}
+
+EffectAnalysis::EffectAnalysis ( Program * prog, Env & globals )
+{
+    for ( const auto & f : globals.funcs ) {
+        if (NativeFunction * n = dynamic_cast<NativeFunction *>(f.second))
+            m_natives[f.first] = n->effect;
+    }
+
+    struct Collector : public AstVisitor
+    {
+        std::map<std::string, std::vector<Function *>> & defs;
+        Collector ( std::map<std::string, std::vector<Function *>> & defs ) : defs(defs) { }
+
+        virtual void visitFunction ( Function * n )
+        {
+            defs[n->name].push_back( n );
+            AstVisitor::visitFunction( n );
+        }
+    } collector( m_defs );
+    prog->accept( collector );
+
+    // Start by assuming that all script functions are pure and iterate until nothing changes,
+    // so that recursive functions can be pure.
+    for ( const auto & d : m_defs )
+        m_pure[d.first] = true;
+    for ( const auto & n : m_natives )
+        m_pure[n.first] = (m_pure.count( n.first ) == 0 || m_pure[n.first]) && n.second == Effect::None;
+
+    bool changed;
+    do {
+        changed = false;
+        for ( const auto & d : m_defs ) {
+            if (!m_pure[d.first])
+                continue;
+            for ( Function * f : d.second ) {
+                if (!bodyIsPure( f )) {
+                    m_pure[d.first] = false;
+                    changed = true;
+                    break;
+                }
+            }
+        }
+    } while (changed);
+}
+
+bool EffectAnalysis::isPure ( const std::string & name ) const
+{
+    auto it = m_pure.find( name );
+    return it != m_pure.end() && it->second;
+}
+
+bool EffectAnalysis::isPure ( Ast * node ) const
+{
+    struct Checker : public AstVisitor
+    {
+        const EffectAnalysis & ea;
+        bool pure = true;
+        Checker ( const EffectAnalysis & ea ) : ea(ea) { }
+
+        virtual void visitAssignIndex ( AssignIndex * )
+        {
+            pure = false;
+        }
+        virtual void visitFunctionCall ( FunctionCall * n )
+        {
+            if (!ea.isPure( n->name ))
+                pure = false;
+            else
+                AstVisitor::visitFunctionCall( n );
+        }
+        // Defining a nested function doesn't execute it.
+        virtual void visitFunction ( Function * ) { }
+    } checker( *this );
+    node->accept( checker );
+    return checker.pure;
+}
+
+bool EffectAnalysis::bodyIsPure ( Function * f ) const
+{
+    return f->body && isPure( f->body );
+}
+
+unsigned EffectAnalysis::callCost ( const std::string & name )
+{
+    auto it = m_cost.find( name );
+    if (it != m_cost.end())
+        return it->second;
+    if (m_costInProgress.count( name ))
+        return UNBOUNDED;
+
+    m_costInProgress.insert( name );
+    unsigned c = isNative( name ) ? 1 : 0;
+    for ( Function * f : definitions( name ) ) {
+        unsigned fc = f->body ? cost( f->body ) : UNBOUNDED;
+        if (fc > c)
+            c = fc;
+    }
+    m_costInProgress.erase( name );
+    return m_cost[name] = c;
+}
+
+unsigned EffectAnalysis::cost ( Ast * node )
+{
+    struct Counter : public AstVisitor
+    {
+        EffectAnalysis & ea;
+        unsigned cost = 0;
+        Counter ( EffectAnalysis & ea ) : ea(ea) { }
+
+        virtual void visitNumber ( Number * ) { cost = addCost( cost, 1 ); }
+        virtual void visitIdent ( Ident * ) { cost = addCost( cost, 1 ); }
+        virtual void visitIndex ( Index * n )
+        {
+            cost = addCost( cost, 1 );
+            AstVisitor::visitIndex( n );
+        }
+        virtual void visitBinOp ( BinOp * n )
+        {
+            cost = addCost( cost, 1 );
+            AstVisitor::visitBinOp( n );
+        }
+        virtual void visitAssign ( Assign * n )
+        {
+            cost = addCost( cost, 1 );
+            AstVisitor::visitAssign( n );
+        }
+        virtual void visitAssignIndex ( AssignIndex * n )
+        {
+            cost = addCost( cost, 1 );
+            AstVisitor::visitAssignIndex( n );
+        }
+        virtual void visitWhile ( While * n )
+        {
+            unsigned save = cost;
+            cost = 0;
+            AstVisitor::visitWhile( n );
+            cost = addCost( save, mulCost( cost, LOOP_COST_FACTOR ) );
+        }
+        virtual void visitFunction ( Function * ) { cost = addCost( cost, 1 ); }
+        virtual void visitFunctionCall ( FunctionCall * n )
+        {
+            cost = addCost( cost, ea.callCost( n->name ) );
+            AstVisitor::visitFunctionCall( n );
+        }
+    } counter( *this );
+    node->accept( counter );
+    return counter.cost;
+}
+
+const std::vector<Function *> & EffectAnalysis::definitions ( const std::string & name ) const
+{
+    static const std::vector<Function *> s_none;
+    auto it = m_defs.find( name );
+    return it != m_defs.end() ? it->second : s_none;
+}
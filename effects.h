@@ -0,0 +1,52 @@
+#ifndef CALC_EFFECTS_H
+#define CALC_EFFECTS_H
+
+#include <set>
+
+#include "ast.h"
+
+/// A conservative analysis of the side effects and the cost of the functions of a program.
+///
+/// Because of dynamic scoping a call can't be bound to a definition statically, so the
+/// properties of a name combine those of every function with that name: all script functions
+/// defined anywhere in the program, nested ones included, and the natives registered in the
+/// global environment.
+///
+/// An assignment always creates or updates a variable in the scope of the current call, so it
+/// can never be observed by the caller and doesn't make a function impure. Assigning an array
+/// element does, since the array is found by dynamic scoping and may belong to a caller.
+class EffectAnalysis
+{
+public:
+    static const unsigned UNBOUNDED = ~0u;
+
+    EffectAnalysis ( Program * prog, Env & globals );
+
+    /// Whether a call to \p name has no side effects.
+    bool isPure ( const std::string & name ) const;
+    /// Whether evaluating \p node has no side effects.
+    bool isPure ( Ast * node ) const;
+
+    /// A rough estimate of the cost of a call to \p name. Recursive functions are UNBOUNDED.
+    unsigned callCost ( const std::string & name );
+    /// A rough estimate of the cost of evaluating \p node.
+    unsigned cost ( Ast * node );
+
+    /// All script functions defined with \p name.
+    const std::vector<Function *> & definitions ( const std::string & name ) const;
+    /// Whether \p name is a native function of the global environment.
+    bool isNative ( const std::string & name ) const { return m_natives.count( name ) != 0; }
+    /// The effect of the native function \p name.
+    Effect::T nativeEffect ( const std::string & name ) const { return m_natives.at( name ); }
+
+private:
+    std::map<std::string, std::vector<Function *>> m_defs;
+    std::map<std::string, Effect::T> m_natives;
+    std::map<std::string, bool> m_pure;
+    std::map<std::string, unsigned> m_cost;
+    std::set<std::string> m_costInProgress;
+
+    bool bodyIsPure ( Function * f ) const;
+};
+
+#endif //CALC_EFFECTS_H
@@ -3,9 +3,16 @@
 #include <string>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
+#include <time.h>
 #include <map>
+#include <mutex>
 
 #include "ast.h"
+#include "parser.h"
+#include "vecops.h"
+#include "scheduler.h"
+#include "parallel.h"
 
 #define _ACODE(t) #t,
 const char * const AstCodeNames[] = { AST_CODES };
@@ -27,6 +34,8 @@ const char * const AstCodeNames[] = { AST_CODES };
     TERM(GT,">")\
     TERM(LBRACE,"{")\
     TERM(RBRACE,"}")\
+    TERM(LBRACKET,"[")\
+    TERM(RBRACKET,"]")\
     TERM(NUMBER,"number") \
     TERM(SEMI,";") \
     TERM(COMMA,",") \
@@ -58,11 +67,18 @@ static long s_number;
 
 static Term s_term = _EOF;
 
+static FILE * s_input = stdin;
+
+/// Whether function bodies are only brace-matched and parsed on the first call.
+static bool s_lazy = false;
+/// Serializes the parsing of lazy function bodies, since the scanner state is global.
+static std::mutex s_lazyMutex;
+
 static std::map<std::string,Term> s_kw;
 
 static int nextChar ()
 {
-    int c = getchar();
+    int c = getc( s_input );
     if (c == '\n') {
         ++s_line;
         s_col = 0;
@@ -89,10 +105,29 @@ static void saveStart ()
     s_startCol = s_col;
 }
 
+static thread_local unsigned t_throwErrors = 0;
+
+ThrowErrors::ThrowErrors ()
+{
+    ++t_throwErrors;
+}
+
+ThrowErrors::~ThrowErrors ()
+{
+    --t_throwErrors;
+}
+
 static void error ( const char * msg, ... )
 {
     va_list  ap;
     va_start(ap, msg);
+    if (t_throwErrors) {
+        char buf[256];
+        int len = snprintf( buf, sizeof(buf), "Error line %d col %d:", s_startLine, s_startCol );
+        vsnprintf( buf + len, sizeof(buf) - len, msg, ap );
+        va_end( ap );
+        throw CalcError( buf );
+    }
     fprintf( stderr, "Error line %d col %d:", s_startLine, s_startCol );
     vfprintf( stderr, msg, ap );
     fputc( '\n', stderr );
@@ -103,6 +138,15 @@ void runtimeError ( const char * msg, ... )
 {
     va_list  ap;
     va_start(ap, msg);
+    if (inFuture() || t_throwErrors) {
+        char buf[256];
+        vsnprintf( buf, sizeof(buf), msg, ap );
+        va_end( ap );
+        // A future is always joined by the thread which started it, which reports the error
+        if (inFuture())
+            throw FutureError{ buf };
+        throw CalcError( buf );
+    }
     fprintf( stderr, "Runtime error:" );
     vfprintf( stderr, msg, ap );
     fputc( '\n', stderr );
@@ -183,6 +227,14 @@ Term getNextTerm ()
             s_nextCh = nextChar();
             return s_term = RBRACE;
         }
+        else if (s_nextCh == '[') {
+            s_nextCh = nextChar();
+            return s_term = LBRACKET;
+        }
+        else if (s_nextCh == ']') {
+            s_nextCh = nextChar();
+            return s_term = RBRACKET;
+        }
         else if (s_nextCh == '<') {
             s_nextCh = nextChar();
             return s_term = LT;
@@ -216,10 +268,10 @@ Term getNextTerm ()
 
 
 static Expr * parseExpression ();
-static Block * parseStatementList ();
+static Block * parseStatementList ( Env * streamEnv = NULL );
 static Statement * parseStatement ();
 static If * parseIf ();
-static Program * parseProgram ();
+static Program * parseProgram ( Env * streamEnv = NULL );
 
 void initParser ()
 {
@@ -256,6 +308,12 @@ static Expr * parseAtom ()
         getNextTerm();
         if (s_term == LPAR)
             res = parseFunctionCall(saveIdent);
+        else if (s_term == LBRACKET) {
+            getNextTerm();
+            Expr * index = parseExpression();
+            need( RBRACKET );
+            res = new Index(saveIdent, index);
+        }
         else
             res = new Ident(saveIdent);
     }
@@ -351,6 +409,25 @@ static While * parseWhile ()
     return new While(cond, body);
 }
 
+/// Skip the body of a function without parsing it. The current term must be its opening brace.
+/// Returns its source, including the matching closing brace.
+static std::string skipBody ()
+{
+    std::string source;
+    for ( int depth = 1; depth; ) {
+        if (s_nextCh == EOF)
+            error( "Unterminated function body" );
+        if (s_nextCh == '{')
+            ++depth;
+        else if (s_nextCh == '}')
+            --depth;
+        source.push_back( (char)s_nextCh );
+        s_nextCh = nextChar();
+    }
+    getNextTerm();
+    return source;
+}
+
 static Function * parseFunction ()
 {
     need(FN);
@@ -374,12 +451,73 @@ static Function * parseFunction ()
         }
     }
     need(RPAR);
+    if (s_lazy) {
+        if (s_term != LBRACE)
+            error( "Expected %s", s_termUI[LBRACE] );
+        int line = s_startLine, col = s_startCol;
+        std::string source = skipBody();
+        return new Function(name, std::move(params), std::move(source), line, col);
+    }
     need(LBRACE);
     Program * body = parseProgram();
     need(RBRACE);
     return new Function(name, std::move(params), body);
 }
 
+/// Parse the body of a lazy function, or load it if it was restored from a snapshot. The scanner
+/// may be in the middle of parsing the main program (when streaming), so its state is saved and
+/// restored.
+Program * Function::parseBody ()
+{
+    std::call_once( bodyParsed, [this]() {
+        if (bodyLoader) {
+            body = bodyLoader();
+            bodyLoader = nullptr;
+            return;
+        }
+        std::lock_guard<std::mutex> lock( s_lazyMutex );
+        FILE * saveInput = s_input;
+        int saveStartLine = s_startLine, saveStartCol = s_startCol, saveLine = s_line, saveCol = s_col;
+        int saveNextCh = s_nextCh;
+        std::string saveIdent = s_ident;
+        long saveNumber = s_number;
+        Term saveTerm = s_term;
+
+        s_input = fmemopen( const_cast<char *>(bodySource.data()), bodySource.size(), "r" );
+        if (!s_input) {
+            perror( "fmemopen" );
+            exit( 1 );
+        }
+        auto restore = [&]() {
+            fclose( s_input );
+            s_input = saveInput;
+            s_startLine = saveStartLine; s_startCol = saveStartCol; s_line = saveLine; s_col = saveCol;
+            s_nextCh = saveNextCh;
+            s_ident = saveIdent;
+            s_number = saveNumber;
+            s_term = saveTerm;
+        };
+        s_line = bodyLine;
+        s_col = bodyCol;
+        // A syntax error may be thrown (see ThrowErrors), in which case the body is parsed
+        // again by the next call
+        try {
+            s_nextCh = nextChar();
+            getNextTerm();
+            Program * prog = parseProgram();
+            need(RBRACE);
+            body = prog;
+        }
+        catch (...) {
+            restore();
+            throw;
+        }
+        restore();
+        std::string().swap( bodySource );
+    } );
+    return body;
+}
+
 static Statement * parseStatement ()
 {
     Statement * res;
@@ -389,6 +527,13 @@ static Statement * parseStatement ()
             getNextTerm();
             if (s_term == LPAR) {
                 res = new StatementExpr( parseFunctionCall( saveIdent ) );
+            } else if (s_term == LBRACKET) {
+                getNextTerm();
+                Expr * index = parseExpression();
+                need( RBRACKET );
+                need( ASSIGN );
+                Expr * value = parseExpression();
+                res = new AssignIndex(saveIdent, index, value);
             } else {
                 need( ASSIGN );
                 Expr * value = parseExpression();
@@ -435,59 +580,107 @@ static Return * parseReturn ()
     return new Return(value);
 }
 
-static Block * parseStatementList ()
+/// Checks whether a statement contains a function definition anywhere inside it. Such
+/// statements must outlive their evaluation, since the environment points into them.
+static bool definesFunction ( Statement * stmt )
+{
+    struct Finder : public AstVisitor
+    {
+        bool found = false;
+        virtual void visitFunction ( Function * ) { found = true; }
+    } finder;
+    stmt->accept( finder );
+    return finder.found;
+}
+
+/// Parse a list of statements. If \p streamEnv is not NULL, every statement is evaluated in it
+/// as soon as it has been parsed and then released (unless it defines a function), instead of
+/// being added to the resulting block. The memory usage then depends on the size of the largest
+/// statement, not on the size of the whole input.
+static Block * parseStatementList ( Env * streamEnv )
 {
     std::vector<StatementPtr> list;
 
     while (s_term == IDENT || s_term == LBRACE || s_term == IF || s_term == WHILE || s_term == SEMI || s_term == FN ) {
         Statement * stmt = parseStatement();
-        if (stmt)
+        if (!stmt)
+            continue;
+        if (streamEnv) {
+            stmt->eval( *streamEnv );
+            if (!definesFunction( stmt ))
+                delete stmt;
+        }
+        else
             list.push_back( StatementPtr(stmt) );
     }
 
     return new Block( std::move(list) );
 }
 
-static Program * parseProgram ()
+/// Parse a program. When streaming (\p streamEnv is not NULL) the top level statements have
+/// already been evaluated when this returns, and only the return statement remains in the result.
+static Program * parseProgram ( Env * streamEnv )
 {
-    Block * body = parseStatementList();
+    Block * body = parseStatementList( streamEnv );
     Return * ret = parseReturn();
     return new Program( body, ret );
 }
 
-struct NativeFunction : public Function
+Program * parseFile ( FILE * input, Env * streamEnv )
 {
-    long (* const fn)(Env & env, const std::vector<ExprPtr> & args);
-    NativeFunction(const char * name, long (*fn)(Env & env, const std::vector<ExprPtr> & args)) :
-            Function( name, std::vector<std::string>(), NULL ), fn(fn) {}
+    s_input = input;
+    initParser();
+    Program * prog = parseProgram( streamEnv );
+    s_input = stdin;
+    return prog;
+}
 
-    virtual void print ( int indent )
-    {
-        printIndent(indent);
-        printf( "Natuve Function %s (", name.c_str() );
-        for ( auto it = params.begin(); it != params.end(); ++it ) {
-            if (it != params.begin())
-                printf( ", " );
-            printf( "%s", it->c_str() );
-        }
-        printf( ")\n" );
-    }
+void setLazyParsing ( bool lazy )
+{
+    s_lazy = lazy;
+}
 
-    virtual long eval ( Env & env )
+unsigned parseAllBodies ( Ast * node )
+{
+    struct Parser : public AstVisitor
     {
-        env.funcs[name] = this;
-        return 0;
-    }
+        unsigned count = 0;
+        virtual void visitFunction ( Function * n )
+        {
+            if (n->lazy && !n->body) {
+                n->parseBody();
+                ++count;
+            }
+            AstVisitor::visitFunction( n );
+        }
+    } parser;
+    node->accept( parser );
+    return parser.count;
+}
 
-    virtual long call ( Env & env, const std::vector<ExprPtr> & args )
-    {
-        return fn( env, args );
+Program * parseString ( const char * source )
+{
+    FILE * f = fmemopen( const_cast<char *>(source), strlen( source ), "r" );
+    if (!f) {
+        perror( "fmemopen" );
+        exit( 1 );
+    }
+    Program * prog;
+    try {
+        prog = parseFile( f );
+    }
+    catch (...) {
+        fclose( f );
+        throw;
     }
-};
+    fclose( f );
+    return prog;
+}
 
-void registerNativeFunction ( Env & env, const char * name, long (*fn)(Env & env, const std::vector<ExprPtr> & args) )
+void registerNativeFunction ( Env & env, const char * name, long (*fn)(Env & env, const std::vector<ExprPtr> & args),
+                              Effect::T effect )
 {
-    NativeFunction * n = new NativeFunction( name, fn );
+    NativeFunction * n = new NativeFunction( name, fn, effect );
     n->eval( env );
 }
 
@@ -502,19 +695,207 @@ static long print ( Env & env, const std::vector<ExprPtr> & args )
     return 0;
 }
 
-int main ()
+static void checkArgCount ( const char * fname, const std::vector<ExprPtr> & args, size_t count )
 {
-    initParser();
-    Program * prog = parseProgram();
-    prog->print(0);
+    if (args.size() != count)
+        runtimeError( "%s() expects %u arguments", fname, (unsigned)count );
+}
+
+/// Array arguments of the builtins are passed by name, so they must be identifiers.
+static const std::string & arrayName ( const char * fname, const std::vector<ExprPtr> & args, size_t i )
+{
+    if (args[i]->code != AstCode::Ident)
+        runtimeError( "%s(): argument %u must be an array name", fname, (unsigned)i + 1 );
+    return static_cast<Ident *>(args[i].get())->name;
+}
+
+/// The result is only valid until more code is evaluated, which could re-create the array, so
+/// scalar arguments must be evaluated first.
+static Array * arrayArg ( const char * fname, Env & env, const std::vector<ExprPtr> & args, size_t i )
+{
+    return env.getArray( arrayName( fname, args, i ) );
+}
+
+/// The destination of an array operation is created in the current scope if it doesn't exist
+/// yet, otherwise it is resized to \p size.
+static Array * destArrayArg ( const char * fname, Env & env, const std::vector<ExprPtr> & args, size_t i,
+                              size_t size )
+{
+    const std::string & name = arrayName( fname, args, i );
+    Array * a = env.findArray( name );
+    if (!a) {
+        ArrayPtr p( new Array( size ) );
+        env.arrays[name] = p;
+        return p.get();
+    }
+    a->data.resize( size );
+    return a;
+}
+
+static void checkSameSize ( const char * fname, Array * a, Array * b )
+{
+    if (a->data.size() != b->data.size())
+        runtimeError( "%s(): array sizes differ (%lu and %lu)", fname,
+                      (unsigned long)a->data.size(), (unsigned long)b->data.size() );
+}
+
+// array(a, size): create a zero-filled array in the current scope
+static long arrayFn ( Env & env, const std::vector<ExprPtr> & args )
+{
+    checkArgCount( "array", args, 2 );
+    const std::string & name = arrayName( "array", args, 0 );
+    long size = args[1]->eval( env );
+    if (size < 0)
+        runtimeError( "array(): invalid size %ld", size );
+    env.arrays[name] = ArrayPtr( new Array( size ) );
+    return size;
+}
+
+// len(a)
+static long lenFn ( Env & env, const std::vector<ExprPtr> & args )
+{
+    checkArgCount( "len", args, 1 );
+    return arrayArg( "len", env, args, 0 )->data.size();
+}
+
+// vsum(a)
+static long vsumFn ( Env & env, const std::vector<ExprPtr> & args )
+{
+    checkArgCount( "vsum", args, 1 );
+    Array * a = arrayArg( "vsum", env, args, 0 );
+    return vecSum( a->data.data(), a->data.size() );
+}
+
+// vmin(a)
+static long vminFn ( Env & env, const std::vector<ExprPtr> & args )
+{
+    checkArgCount( "vmin", args, 1 );
+    Array * a = arrayArg( "vmin", env, args, 0 );
+    if (a->data.empty())
+        runtimeError( "vmin(): empty array" );
+    return vecMin( a->data.data(), a->data.size() );
+}
+
+// vmax(a)
+static long vmaxFn ( Env & env, const std::vector<ExprPtr> & args )
+{
+    checkArgCount( "vmax", args, 1 );
+    Array * a = arrayArg( "vmax", env, args, 0 );
+    if (a->data.empty())
+        runtimeError( "vmax(): empty array" );
+    return vecMax( a->data.data(), a->data.size() );
+}
+
+// vdot(a, b)
+static long vdotFn ( Env & env, const std::vector<ExprPtr> & args )
+{
+    checkArgCount( "vdot", args, 2 );
+    Array * a = arrayArg( "vdot", env, args, 0 );
+    Array * b = arrayArg( "vdot", env, args, 1 );
+    checkSameSize( "vdot", a, b );
+    return vecDot( a->data.data(), b->data.data(), a->data.size() );
+}
 
-    Env env(NULL);
-    registerNativeFunction( env, "print", print );
+// vadd(d, a, b): d[i] = a[i] + b[i]
+static long vaddFn ( Env & env, const std::vector<ExprPtr> & args )
+{
+    checkArgCount( "vadd", args, 3 );
+    Array * a = arrayArg( "vadd", env, args, 1 );
+    Array * b = arrayArg( "vadd", env, args, 2 );
+    checkSameSize( "vadd", a, b );
+    Array * d = destArrayArg( "vadd", env, args, 0, a->data.size() );
+    vecAdd( d->data.data(), a->data.data(), b->data.data(), d->data.size() );
+    return d->data.size();
+}
 
-    long result = prog->eval( env );
-    for ( const auto & var : env.vars )
-        printf( "%s = %ld\n", var.first.c_str(), var.second );
-    printf( "\nReturned result: %ld\n", result );
+// vmul(d, a, b): d[i] = a[i] * b[i]
+static long vmulFn ( Env & env, const std::vector<ExprPtr> & args )
+{
+    checkArgCount( "vmul", args, 3 );
+    Array * a = arrayArg( "vmul", env, args, 1 );
+    Array * b = arrayArg( "vmul", env, args, 2 );
+    checkSameSize( "vmul", a, b );
+    Array * d = destArrayArg( "vmul", env, args, 0, a->data.size() );
+    vecMul( d->data.data(), a->data.data(), b->data.data(), d->data.size() );
+    return d->data.size();
+}
+
+// vadds(d, a, s): d[i] = a[i] + s
+static long vaddsFn ( Env & env, const std::vector<ExprPtr> & args )
+{
+    checkArgCount( "vadds", args, 3 );
+    long s = args[2]->eval( env );
+    Array * a = arrayArg( "vadds", env, args, 1 );
+    Array * d = destArrayArg( "vadds", env, args, 0, a->data.size() );
+    vecAddScalar( d->data.data(), a->data.data(), s, d->data.size() );
+    return d->data.size();
+}
+
+// vmuls(d, a, s): d[i] = a[i] * s
+static long vmulsFn ( Env & env, const std::vector<ExprPtr> & args )
+{
+    checkArgCount( "vmuls", args, 3 );
+    long s = args[2]->eval( env );
+    Array * a = arrayArg( "vmuls", env, args, 1 );
+    Array * d = destArrayArg( "vmuls", env, args, 0, a->data.size() );
+    vecMulScalar( d->data.data(), a->data.data(), s, d->data.size() );
+    return d->data.size();
+}
+
+// vfill(a, s): a[i] = s
+static long vfillFn ( Env & env, const std::vector<ExprPtr> & args )
+{
+    checkArgCount( "vfill", args, 2 );
+    long s = args[1]->eval( env );
+    Array * a = arrayArg( "vfill", env, args, 0 );
+    vecFill( a->data.data(), s, a->data.size() );
+    return a->data.size();
+}
+
+// vscan(d, a): d[i] = a[0] + ... + a[i]
+static long vscanFn ( Env & env, const std::vector<ExprPtr> & args )
+{
+    checkArgCount( "vscan", args, 2 );
+    Array * a = arrayArg( "vscan", env, args, 1 );
+    Array * d = destArrayArg( "vscan", env, args, 0, a->data.size() );
+    vecPrefixSum( d->data.data(), a->data.data(), d->data.size() );
+    return d->data.size();
+}
+
+// sleep(ms): wait for the specified number of milliseconds. When running under the scheduler
+// only the calling script is suspended, otherwise the whole process blocks.
+static long sleepFn ( Env & env, const std::vector<ExprPtr> & args )
+{
+    checkArgCount( "sleep", args, 1 );
+    long ms = args[0]->eval( env );
+    if (Scheduler * sched = Scheduler::current())
+        sched->sleep( ms );
+    else if (ms > 0) {
+        struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+        nanosleep( &ts, NULL );
+    }
     return 0;
 }
 
+static void registerArrayFunctions ( Env & env )
+{
+    registerNativeFunction( env, "array", arrayFn );
+    registerNativeFunction( env, "len", lenFn, Effect::None );
+    registerNativeFunction( env, "vsum", vsumFn, Effect::None );
+    registerNativeFunction( env, "vmin", vminFn, Effect::None );
+    registerNativeFunction( env, "vmax", vmaxFn, Effect::None );
+    registerNativeFunction( env, "vdot", vdotFn, Effect::None );
+    registerNativeFunction( env, "vadd", vaddFn );
+    registerNativeFunction( env, "vmul", vmulFn );
+    registerNativeFunction( env, "vadds", vaddsFn );
+    registerNativeFunction( env, "vmuls", vmulsFn );
+    registerNativeFunction( env, "vfill", vfillFn );
+    registerNativeFunction( env, "vscan", vscanFn );
+}
+
+void registerBuiltins ( Env & env )
+{
+    registerNativeFunction( env, "print", print, Effect::Output );
+    registerNativeFunction( env, "sleep", sleepFn, Effect::Output );
+    registerArrayFunctions( env );
+}
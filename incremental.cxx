@@ -0,0 +1,173 @@
+#include "incremental.h"
+
+namespace {
+
+/// What evaluating some code can depend on.
+struct Summary
+{
+    bool untracked = false;
+    std::set<std::string> reads;
+
+    bool operator == ( const Summary & o ) const { return untracked == o.untracked && reads == o.reads; }
+    bool operator != ( const Summary & o ) const { return !(*this == o); }
+};
+
+/// Collects the variables read and assigned by some code, and the globals read by the functions
+/// it calls according to \p funcs. Functions missing from \p funcs can't be tracked.
+struct Tracker : public AstVisitor
+{
+    const std::map<std::string, Summary> & funcs;
+    Summary res;
+    std::set<std::string> writes;
+
+    Tracker ( const std::map<std::string, Summary> & funcs ) : funcs(funcs) { }
+
+    virtual void visitIdent ( Ident * n ) { res.reads.insert( n->name ); }
+    virtual void visitIndex ( Index * ) { res.untracked = true; }
+    virtual void visitAssignIndex ( AssignIndex * ) { res.untracked = true; }
+    virtual void visitWhile ( While * n )
+    {
+        // The loop must still be visited for its assignments, to mark them dirty when it runs
+        res.untracked = true;
+        AstVisitor::visitWhile( n );
+    }
+    virtual void visitFunction ( Function * ) { res.untracked = true; }
+    virtual void visitAssign ( Assign * n )
+    {
+        writes.insert( n->name );
+        AstVisitor::visitAssign( n );
+    }
+    virtual void visitFunctionCall ( FunctionCall * n )
+    {
+        auto it = funcs.find( n->name );
+        if (it == funcs.end() || it->second.untracked)
+            res.untracked = true;
+        else
+            res.reads.insert( it->second.reads.begin(), it->second.reads.end() );
+        AstVisitor::visitFunctionCall( n );
+    }
+};
+
+}
+
+IncrementalProgram::IncrementalProgram ( Program * prog, Env & globals ) : m_prog(prog)
+{
+    struct Collector : public AstVisitor
+    {
+        std::map<std::string, std::vector<Function *>> defs;
+        virtual void visitFunction ( Function * n )
+        {
+            defs[n->name].push_back( n );
+            AstVisitor::visitFunction( n );
+        }
+    } collector;
+    prog->accept( collector );
+
+    // Summarize the globals read by every script function (its parameters are local, even for
+    // the functions it calls). Start with nothing and iterate until nothing changes, so that
+    // recursive functions can be tracked. Natives are never tracked.
+    std::map<std::string, Summary> funcs;
+    for ( const auto & d : collector.defs ) {
+        auto it = globals.funcs.find( d.first );
+        if (it == globals.funcs.end() || !dynamic_cast<NativeFunction *>(it->second))
+            funcs[d.first];
+    }
+    bool changed;
+    do {
+        changed = false;
+        for ( auto & f : funcs ) {
+            Summary sum;
+            for ( Function * fn : collector.defs[f.first] ) {
+                if (!fn->body) {
+                    sum.untracked = true;
+                    break;
+                }
+                Tracker tracker( funcs );
+                fn->body->accept( tracker );
+                for ( const auto & p : fn->params )
+                    tracker.res.reads.erase( p );
+                sum.untracked |= tracker.res.untracked;
+                sum.reads.insert( tracker.res.reads.begin(), tracker.res.reads.end() );
+            }
+            if (sum != f.second) {
+                f.second = sum;
+                changed = true;
+            }
+        }
+    } while (changed);
+
+    for ( const auto & sp : prog->body->list ) {
+        Tracker tracker( funcs );
+        sp->accept( tracker );
+        m_stmts.push_back( Stmt() );
+        Stmt & s = m_stmts.back();
+        s.stmt = sp.get();
+        s.untracked = tracker.res.untracked;
+        s.reads.swap( tracker.res.reads );
+        s.writes.swap( tracker.writes );
+    }
+    Tracker tracker( funcs );
+    prog->returnStmt->accept( tracker );
+    m_return.stmt = prog->returnStmt;
+    m_return.untracked = tracker.res.untracked;
+    m_return.reads.swap( tracker.res.reads );
+}
+
+/// A statement must be evaluated again if a variable it reads has changed, and also if one it
+/// assigns has changed, since it may not assign it in every run.
+static bool isDirty ( const std::set<std::string> & vars, const std::set<std::string> & dirty )
+{
+    for ( const auto & v : vars ) {
+        if (dirty.count( v ))
+            return true;
+    }
+    return false;
+}
+
+void IncrementalProgram::evalStmt ( Stmt & s, Env & env, std::set<std::string> & dirty )
+{
+    if (!m_first && !s.untracked && !isDirty( s.reads, dirty ) && !isDirty( s.writes, dirty )) {
+        for ( const auto & v : s.values )
+            env.vars[v.first] = v.second;
+        ++m_reused;
+        return;
+    }
+
+    ++m_recomputed;
+    long result = s.stmt->eval( env );
+    if (&s == &m_return)
+        m_result = result;
+
+    std::map<std::string, long> values;
+    for ( const auto & w : s.writes ) {
+        auto it = env.vars.find( w );
+        if (it != env.vars.end())
+            values[w] = it->second;
+        auto old = s.values.find( w );
+        if ((it == env.vars.end()) != (old == s.values.end()) || (old != s.values.end() && old->second != it->second))
+            dirty.insert( w );
+    }
+    s.values.swap( values );
+}
+
+long IncrementalProgram::run ( Env & env )
+{
+    std::set<std::string> dirty;
+    for ( const auto & v : env.vars ) {
+        auto it = m_inputs.find( v.first );
+        if (it == m_inputs.end() || it->second != v.second)
+            dirty.insert( v.first );
+    }
+    for ( const auto & v : m_inputs ) {
+        if (!env.vars.count( v.first ))
+            dirty.insert( v.first );
+    }
+    m_inputs = env.vars;
+
+    m_recomputed = m_reused = 0;
+    for ( auto & s : m_stmts )
+        evalStmt( s, env, dirty );
+    evalStmt( m_return, env, dirty );
+    m_first = false;
+    return m_result;
+}
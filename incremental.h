@@ -0,0 +1,55 @@
+#ifndef CALC_INCREMENTAL_H
+#define CALC_INCREMENTAL_H
+
+#include "ast.h"
+
+#include <set>
+
+/// Evaluates a program repeatedly with different values of its input variables, recomputing
+/// only the top level statements which depend on variables that have changed since the
+/// previous run.
+///
+/// Every top level statement records the variables it reads, including the globals read by the
+/// functions it calls, and the values of the variables it has assigned. If none of the variables
+/// it reads has changed, the recorded values are simply restored. Statements which can't be
+/// tracked are always evaluated: loops, accesses to arrays, calls to natives (which may produce
+/// output or read arrays), calls to functions which do any of these or haven't been parsed yet,
+/// and definitions of functions.
+class IncrementalProgram
+{
+public:
+    /// \p globals are the globals of the analysis, with the builtins. The program must not have
+    /// been optimized (the temporaries of CSE and inlining are not tracked).
+    IncrementalProgram ( Program * prog, Env & globals );
+
+    /// Evaluate the program in \p env, which must contain only the input variables. The
+    /// inputs which differ from the previous run determine what is recomputed.
+    long run ( Env & env );
+
+    /// Number of statements (including the return) evaluated and reused in the last run.
+    unsigned recomputed () const { return m_recomputed; }
+    unsigned reused () const { return m_reused; }
+
+private:
+    struct Stmt
+    {
+        Ast * stmt;
+        /// Whether the statement must always be evaluated.
+        bool untracked = false;
+        std::set<std::string> reads, writes;
+        /// The values of the assigned variables after the last evaluation.
+        std::map<std::string, long> values;
+    };
+
+    Program * const m_prog;
+    std::vector<Stmt> m_stmts;
+    Stmt m_return;
+    long m_result = 0;
+    bool m_first = true;
+    std::map<std::string, long> m_inputs;
+    unsigned m_recomputed = 0, m_reused = 0;
+
+    void evalStmt ( Stmt & s, Env & env, std::set<std::string> & dirty );
+};
+
+#endif //CALC_INCREMENTAL_H
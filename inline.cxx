@@ -0,0 +1,240 @@
+#include "opt.h"
+#include "effects.h"
+
+#include <set>
+
+// A function can be inlined if its body consists only of assignments followed by the return,
+// and it is small. Its parameters and assigned variables are then mapped to temporaries of the
+// caller. This is only possible if the body doesn't call anything, since with dynamic scoping
+// the callees could see them. A function with calls can still be inlined if it doesn't have
+// any parameters or variables (so its scope would be empty), and it calls only script
+// functions and natives which don't modify the environment (which would otherwise be the scope
+// of the caller instead of the callee).
+//
+// Reading a variable of the callee before it has been assigned reads the variable of the caller
+// (or an outer scope), which is exactly what an identifier at the call site does.
+
+/// The inlinable parts of a function, cloned before any call sites have been changed.
+struct Template
+{
+    Function * fn;
+    std::vector<std::pair<std::string, Expr *>> assigns;
+    Expr * result;
+};
+
+/// Clone an expression of an inlinable function, replacing the variables in \p locals.
+static Expr * clone ( Expr * e, const std::map<std::string, unsigned> & locals )
+{
+    if (Number * n = dynamic_cast<Number *>(e))
+        return new Number( n->value );
+    if (Ident * id = dynamic_cast<Ident *>(e)) {
+        auto it = locals.find( id->name );
+        if (it != locals.end())
+            return new Local( it->second );
+        return new Ident( id->name );
+    }
+    if (Index * ix = dynamic_cast<Index *>(e))
+        return new Index( ix->name, clone( ix->index, locals ) );
+    if (BinOp * op = dynamic_cast<BinOp *>(e))
+        return new BinOp( op->code, clone( op->left, locals ), clone( op->right, locals ) );
+    if (FunctionCall * call = dynamic_cast<FunctionCall *>(e)) {
+        std::vector<ExprPtr> args;
+        for ( const auto & a : call->args )
+            args.push_back( ExprPtr( clone( a.get(), locals ) ) );
+        return new FunctionCall( call->name, std::move( args ) );
+    }
+    assert( false );
+    return NULL;
+}
+
+class Inliner : public AstVisitor
+{
+public:
+    unsigned count = 0;
+
+    Inliner ( Program * prog, Env & globals ) : m_effects( prog, globals )
+    {
+        struct Collector : public AstVisitor
+        {
+            std::vector<Function *> funcs;
+            virtual void visitFunction ( Function * n )
+            {
+                funcs.push_back( n );
+                AstVisitor::visitFunction( n );
+            }
+        } collector;
+        prog->accept( collector );
+
+        std::map<std::string, unsigned> none;
+        for ( Function * f : collector.funcs ) {
+            if (!isInlinable( f ))
+                continue;
+            Template & t = m_templates[f->name];
+            t.fn = f;
+            for ( const auto & sp : f->body->body->list ) {
+                Assign * a = static_cast<Assign *>(sp.get());
+                t.assigns.push_back( std::make_pair( a->name, clone( a->value, none ) ) );
+            }
+            t.result = clone( f->body->returnStmt->value, none );
+        }
+    }
+
+    virtual void visitIndex ( Index * n ) { rewrite( n->index ); }
+    virtual void visitBinOp ( BinOp * n )
+    {
+        rewrite( n->left );
+        rewrite( n->right );
+    }
+    virtual void visitFunctionCall ( FunctionCall * n )
+    {
+        for ( auto & a : n->args )
+            rewrite( a );
+    }
+    virtual void visitReturn ( Return * n ) { rewrite( n->value ); }
+    virtual void visitStatementExpr ( StatementExpr * n ) { rewrite( n->expr ); }
+    virtual void visitIf ( If * n )
+    {
+        rewrite( n->cond );
+        n->thenClause->accept( *this );
+        if (n->elseClause)
+            n->elseClause->accept( *this );
+    }
+    virtual void visitWhile ( While * n )
+    {
+        rewrite( n->cond );
+        n->body->accept( *this );
+    }
+    virtual void visitAssign ( Assign * n ) { rewrite( n->value ); }
+    virtual void visitAssignIndex ( AssignIndex * n )
+    {
+        rewrite( n->index );
+        rewrite( n->value );
+    }
+    virtual void visitProgram ( Program * n )
+    {
+        Program * save = m_prog;
+        m_prog = n;
+        AstVisitor::visitProgram( n );
+        m_prog = save;
+    }
+
+private:
+    EffectAnalysis m_effects;
+    std::map<std::string, Template> m_templates;
+    Program * m_prog = NULL;
+
+    /// Whether \p fn calls itself, directly or indirectly.
+    bool isRecursive ( Function * fn )
+    {
+        std::set<std::string> seen;
+        std::vector<std::string> work;
+        work.push_back( fn->name );
+        while (!work.empty()) {
+            std::string name = work.back();
+            work.pop_back();
+            for ( Function * f : m_effects.definitions( name ) ) {
+                if (!f->body)
+                    continue;
+                for ( const auto & callee : calledNames( f->body ) ) {
+                    if (callee == fn->name)
+                        return true;
+                    if (seen.insert( callee ).second)
+                        work.push_back( callee );
+                }
+            }
+        }
+        return false;
+    }
+
+    static std::set<std::string> calledNames ( Ast * node )
+    {
+        struct Finder : public AstVisitor
+        {
+            std::set<std::string> names;
+            virtual void visitFunctionCall ( FunctionCall * n )
+            {
+                names.insert( n->name );
+                AstVisitor::visitFunctionCall( n );
+            }
+        } finder;
+        node->accept( finder );
+        return finder.names;
+    }
+
+    bool isInlinable ( Function * fn )
+    {
+        // The callee must be known statically
+        if (!fn->body || m_effects.definitions( fn->name ).size() != 1 || m_effects.isNative( fn->name ))
+            return false;
+        const auto & list = fn->body->body->list;
+        for ( const auto & sp : list ) {
+            if (!dynamic_cast<Assign *>(sp.get()))
+                return false;
+        }
+        if (countNodes( fn->body ) > INLINE_MAX_NODES)
+            return false;
+
+        std::set<std::string> callees = calledNames( fn->body );
+        if (callees.empty())
+            return true;
+        if (!fn->params.empty() || !list.empty())
+            return false;
+        for ( const auto & name : callees ) {
+            if (m_effects.isNative( name ) && m_effects.nativeEffect( name ) == Effect::State)
+                return false;
+        }
+        return !isRecursive( fn );
+    }
+
+    InlinedCall * instantiate ( const std::shared_ptr<FunctionCall> & call, const Template & t )
+    {
+        unsigned firstSlot = m_prog->numTemps;
+        std::map<std::string, unsigned> locals;
+        for ( const auto & param : t.fn->params )
+            locals[param] = m_prog->numTemps++;
+
+        std::vector<StatementPtr> body;
+        for ( const auto & a : t.assigns ) {
+            Expr * value = clone( a.second, locals );
+            auto it = locals.find( a.first );
+            unsigned slot = it != locals.end() ? it->second : (locals[a.first] = m_prog->numTemps++);
+            body.push_back( StatementPtr( new AssignLocal( slot, value ) ) );
+        }
+
+        InlinedCall * res = new InlinedCall( call, t.fn, firstSlot, std::move( body ), clone( t.result, locals ) );
+        ++count;
+        // The body contains calls only if there are no locals
+        rewrite( res->result );
+        return res;
+    }
+
+    const Template * findTemplate ( Expr * e )
+    {
+        FunctionCall * call = dynamic_cast<FunctionCall *>(e);
+        if (!call)
+            return NULL;
+        auto it = m_templates.find( call->name );
+        return it != m_templates.end() ? &it->second : NULL;
+    }
+
+    void rewrite ( Expr * & e )
+    {
+        e->accept( *this );
+        if (const Template * t = findTemplate( e ))
+            e = instantiate( std::shared_ptr<FunctionCall>( static_cast<FunctionCall *>(e) ), *t );
+    }
+
+    void rewrite ( ExprPtr & e )
+    {
+        e->accept( *this );
+        if (const Template * t = findTemplate( e.get() ))
+            e = ExprPtr( instantiate( std::static_pointer_cast<FunctionCall>( e ), *t ) );
+    }
+};
+
+unsigned inlineFunctions ( Program * prog, Env & globals )
+{
+    Inliner inliner( prog, globals );
+    prog->accept( inliner );
+    return inliner.count;
+}
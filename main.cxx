@@ -0,0 +1,304 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <map>
+#include <thread>
+
+#include "ast.h"
+#include "parser.h"
+#include "scheduler.h"
+#include "parallel.h"
+#include "prepared.h"
+#include "opt.h"
+#include "incremental.h"
+#include "snapshot.h"
+
+static void usage ()
+{
+    fprintf( stderr,
+        "syntax: calc [options] < input\n"
+        "  -stream     evaluate top level statements as they are parsed\n"
+        "  -tasks N    run N concurrent instances of the program under the scheduler\n"
+        "  -stack KB   stack size of every task for -tasks (default: 8192)\n"
+        "  -parallel   evaluate independent expensive pure calls in parallel\n"
+        "  -threads N  number of threads for -parallel and -batch (default: number of CPUs)\n"
+        "  -batch N    benchmark the evaluation of the program for N rows of random inputs\n"
+        "  -inputs a,b,...  the input variables for -batch\n"
+        "  -cse        eliminate common subexpressions\n"
+        "  -inline     inline small functions\n"
+        "  -lazy       parse function bodies on their first call\n"
+        "  -strict     check the syntax of all function bodies before evaluating (with -lazy)\n"
+        "  -D name=value  define an input variable\n"
+        "  -rerun name=value,...  evaluate the program again with changed inputs, recomputing\n"
+        "              only the statements which depend on them (may be repeated)\n"
+        "  -snapshot-in FILE   start with the globals saved in a snapshot\n"
+        "  -snapshot-out FILE  save the globals to a snapshot after running the program\n"
+    );
+    exit( 1 );
+}
+
+static long elapsedMs ( const struct timespec & start )
+{
+    struct timespec end;
+    clock_gettime( CLOCK_MONOTONIC, &end );
+    return (end.tv_sec - start.tv_sec) * 1000L + (end.tv_nsec - start.tv_nsec) / 1000000;
+}
+
+/// Run \p count instances of the program concurrently, each in its own scope.
+static int runTasks ( Program * prog, Env & env, long count, size_t stackSize )
+{
+    struct timespec start;
+    clock_gettime( CLOCK_MONOTONIC, &start );
+
+    Scheduler sched( stackSize );
+    std::vector<Env *> envs;
+    std::vector<Task *> tasks;
+    for ( long i = 0; i < count; ++i ) {
+        envs.push_back( new Env( &env ) );
+        tasks.push_back( sched.spawn( prog, envs.back() ) );
+    }
+    sched.run();
+
+    long ms = elapsedMs( start );
+    printf( "\nReturned result: %ld\n", tasks[0]->result );
+    printf( "%ld tasks completed in %ld ms (%.0f tasks/s)\n", count, ms, count * 1000.0 / (ms ? ms : 1) );
+
+    for ( Env * e : envs )
+        delete e;
+    return 0;
+}
+
+static std::vector<std::string> splitNames ( const char * list )
+{
+    std::vector<std::string> names;
+    std::string name;
+    for ( const char * p = list; ; ++p ) {
+        if (*p == ',' || !*p) {
+            if (!name.empty())
+                names.push_back( name );
+            name.clear();
+            if (!*p)
+                break;
+        }
+        else
+            name.push_back( *p );
+    }
+    return names;
+}
+
+static long timeRun ( PreparedProgram & prog, const std::vector<const long *> & columns, long rows,
+                      std::vector<long> & output, unsigned threads )
+{
+    struct timespec start;
+    clock_gettime( CLOCK_MONOTONIC, &start );
+    prog.run( columns.data(), rows, output.data(), threads );
+    return elapsedMs( start );
+}
+
+/// Parse "name=value,name=value,..." into \p vars.
+static bool parseAssignments ( const char * list, std::map<std::string, long> & vars )
+{
+    for ( const auto & item : splitNames( list ) ) {
+        size_t eq = item.find( '=' );
+        if (eq == 0 || eq == std::string::npos || eq + 1 == item.size())
+            return false;
+        char * end;
+        long value = strtol( item.c_str() + eq + 1, &end, 10 );
+        if (*end)
+            return false;
+        vars[item.substr( 0, eq )] = value;
+    }
+    return true;
+}
+
+static void printVars ( Env & env )
+{
+    for ( const auto & var : env.vars )
+        printf( "%s = %ld\n", var.first.c_str(), var.second );
+    for ( const auto & arr : env.arrays )
+        printf( "%s[%lu]\n", arr.first.c_str(), (unsigned long)arr.second->data.size() );
+}
+
+/// Evaluate the program with \p inputs, and then again after applying each of \p reruns.
+static int runIncremental ( Program * prog, Env & globals, std::map<std::string, long> inputs,
+                            const std::vector<std::map<std::string, long>> & reruns )
+{
+    prog->print(0);
+    IncrementalProgram inc( prog, globals );
+    for ( size_t i = 0; i <= reruns.size(); ++i ) {
+        if (i) {
+            printf( "\nRerun with" );
+            for ( const auto & v : reruns[i-1] ) {
+                printf( " %s=%ld", v.first.c_str(), v.second );
+                inputs[v.first] = v.second;
+            }
+            printf( "\n" );
+        }
+        Env env( &globals );
+        env.vars = inputs;
+        long result = inc.run( env );
+        printVars( env );
+        printf( "Statements recomputed: %u, reused: %u\n", inc.recomputed(), inc.reused() );
+        printf( "Returned result: %ld\n", result );
+    }
+    return 0;
+}
+
+/// Evaluate the program for \p rows rows of random inputs, interpreting every row and with
+/// prepared programs using one and \p threads threads, and report the speed.
+static int runBatch ( long rows, const std::vector<std::string> & inputs, unsigned threads )
+{
+    std::string source;
+    int c;
+    while ((c = getchar()) != EOF)
+        source.push_back( (char)c );
+
+    std::vector<std::vector<long>> data( inputs.size(), std::vector<long>( rows ) );
+    std::vector<const long *> columns;
+    unsigned long seed = 12345;
+    for ( auto & col : data ) {
+        for ( long & v : col ) {
+            seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+            v = (long)(seed >> 33) % 1000;
+        }
+        columns.push_back( col.data() );
+    }
+
+    PreparedProgram rowProg( source.c_str(), inputs, false );
+    PreparedProgram batchProg( source.c_str(), inputs );
+    printf( "%lu statements and %s return executed in batches\n", (unsigned long)batchProg.batchStatements(),
+            batchProg.batchReturn() ? "the" : "not the" );
+
+    std::vector<long> expected( rows ), output( rows );
+    long ms = timeRun( rowProg, columns, rows, expected, 1 );
+    printf( "row by row:            %10.0f rows/s\n", rows * 1000.0 / (ms ? ms : 1) );
+    ms = timeRun( batchProg, columns, rows, output, 1 );
+    printf( "batches, 1 thread:     %10.0f rows/s\n", rows * 1000.0 / (ms ? ms : 1) );
+    if (output != expected)
+        runtimeError( "Batch evaluation produced different results" );
+    ms = timeRun( batchProg, columns, rows, output, threads );
+    printf( "batches, %2u threads:   %10.0f rows/s\n", threads, rows * 1000.0 / (ms ? ms : 1) );
+    if (output != expected)
+        runtimeError( "Batch evaluation produced different results" );
+
+    long sum = 0;
+    for ( long v : output )
+        sum += v;
+    printf( "\nSum of results: %ld\n", sum );
+    return 0;
+}
+
+int main ( int argc, char ** argv )
+{
+    bool stream = false;
+    long tasks = 0;
+    long stackKB = Scheduler::DEFAULT_STACK_SIZE / 1024;
+    bool parallel = false;
+    long threads = std::thread::hardware_concurrency();
+    long batch = 0;
+    std::vector<std::string> inputs;
+    bool cse = false;
+    bool inlining = false;
+    bool lazy = false;
+    bool strict = false;
+    std::map<std::string, long> defines;
+    std::vector<std::map<std::string, long>> reruns;
+    const char * snapshotIn = NULL;
+    const char * snapshotOut = NULL;
+
+    for ( int i = 1; i < argc; ++i ) {
+        if (strcmp( argv[i], "-stream" ) == 0)
+            stream = true;
+        else if (strcmp( argv[i], "-tasks" ) == 0 && i + 1 < argc && (tasks = atol( argv[i+1] )) > 0)
+            ++i;
+        else if (strcmp( argv[i], "-stack" ) == 0 && i + 1 < argc &&
+                 (stackKB = atol( argv[i+1] )) >= (long)(Scheduler::MIN_STACK_SIZE / 1024))
+            ++i;
+        else if (strcmp( argv[i], "-parallel" ) == 0)
+            parallel = true;
+        else if (strcmp( argv[i], "-threads" ) == 0 && i + 1 < argc && (threads = atol( argv[i+1] )) > 0)
+            ++i;
+        else if (strcmp( argv[i], "-batch" ) == 0 && i + 1 < argc && (batch = atol( argv[i+1] )) > 0)
+            ++i;
+        else if (strcmp( argv[i], "-inputs" ) == 0 && i + 1 < argc)
+            inputs = splitNames( argv[++i] );
+        else if (strcmp( argv[i], "-cse" ) == 0)
+            cse = true;
+        else if (strcmp( argv[i], "-inline" ) == 0)
+            inlining = true;
+        else if (strcmp( argv[i], "-lazy" ) == 0)
+            lazy = true;
+        else if (strcmp( argv[i], "-strict" ) == 0)
+            strict = true;
+        else if (strcmp( argv[i], "-D" ) == 0 && i + 1 < argc && parseAssignments( argv[i+1], defines ))
+            ++i;
+        else if (strcmp( argv[i], "-snapshot-in" ) == 0 && i + 1 < argc)
+            snapshotIn = argv[++i];
+        else if (strcmp( argv[i], "-snapshot-out" ) == 0 && i + 1 < argc)
+            snapshotOut = argv[++i];
+        else if (strcmp( argv[i], "-rerun" ) == 0 && i + 1 < argc) {
+            reruns.push_back( std::map<std::string, long>() );
+            if (!parseAssignments( argv[++i], reruns.back() ))
+                usage();
+        }
+        else
+            usage();
+    }
+    if ((stream != 0) + (tasks != 0) + parallel + (batch != 0) + !reruns.empty() > 1)
+        usage();
+    // Optimizations need the whole program
+    if ((cse || inlining || strict) && (stream || batch))
+        usage();
+    // The temporaries of the optimizations are not tracked
+    if ((cse || inlining) && !reruns.empty())
+        usage();
+    // Snapshots are of the global scope, and can't contain optimized code
+    if (snapshotIn && batch)
+        usage();
+    if (snapshotOut && (tasks || batch || !reruns.empty() || cse || inlining))
+        usage();
+    setLazyParsing( lazy );
+
+    if (batch)
+        return runBatch( batch, inputs, threads );
+
+    Env env(NULL);
+    registerBuiltins( env );
+    if (snapshotIn)
+        loadSnapshot( snapshotIn, env );
+    for ( const auto & v : defines )
+        env.vars[v.first] = v.second;
+
+    Program * prog = parseFile( stdin, stream ? &env : NULL );
+    if (strict)
+        parseAllBodies( prog );
+    if (inlining)
+        printf( "Inlined %u calls\n", inlineFunctions( prog, env ) );
+    if (cse) {
+        CseStats stats = eliminateCommonSubexpressions( prog );
+        printf( "CSE: %u subexpressions reused, %u nodes eliminated\n", stats.reused, stats.eliminatedNodes );
+    }
+    if (tasks)
+        return runTasks( prog, env, tasks, stackKB * 1024 );
+    if (!reruns.empty()) {
+        // The inputs are defined by every run; keep the globals restored from a snapshot
+        for ( const auto & v : defines )
+            env.vars.erase( v.first );
+        return runIncremental( prog, env, defines, reruns );
+    }
+    if (parallel) {
+        startParallel( threads );
+        markParallelCalls( prog, env );
+    }
+    if (!stream)
+        prog->print(0);
+
+    long result = prog->eval( env );
+    printVars( env );
+    printf( "\nReturned result: %ld\n", result );
+    if (snapshotOut)
+        saveSnapshot( snapshotOut, env );
+    return 0;
+}
+
@@ -0,0 +1,32 @@
+#ifndef CALC_OPT_H
+#define CALC_OPT_H
+
+#include "ast.h"
+
+// Optimization passes over a whole program. They must run before the program is evaluated.
+
+struct CseStats
+{
+    /// Number of subexpressions replaced by the value of an earlier identical one
+    unsigned reused = 0;
+    /// Number of nodes removed from the tree by that
+    unsigned eliminatedNodes = 0;
+};
+
+/// Common subexpression elimination. Identical arithmetic subexpressions are numbered the same
+/// (hash-consing the expressions into a DAG) and the value of the first one is reused by the
+/// following ones, as long as none of their variables has been assigned in between.
+CseStats eliminateCommonSubexpressions ( Program * prog );
+
+/// Functions with at most this many expression nodes may be inlined.
+#define INLINE_MAX_NODES 32
+
+/// Substitute the bodies of small non-recursive functions at their call sites, when the name
+/// of the callee is bound to a single function. Must run before the other passes. Returns the
+/// number of inlined calls.
+unsigned inlineFunctions ( Program * prog, Env & globals );
+
+/// The number of expression nodes in \p node.
+unsigned countNodes ( Ast * node );
+
+#endif //CALC_OPT_H
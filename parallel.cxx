@@ -0,0 +1,321 @@
+#include "parallel.h"
+#include "effects.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+struct Future
+{
+    FunctionCall * const call;
+    Env * const env;
+    std::atomic<bool> done;
+    bool joined = false;
+    bool failed = false;
+    long value = 0;
+    std::string error;
+
+    Future(FunctionCall *const call, Env *const env) : call(call), env(env), done(false) { }
+};
+
+/// The futures started by a group of operands.
+struct FutureFrame
+{
+    FutureFrame * const prev;
+    Env * const env;
+    std::vector<Future *> futures;
+
+    FutureFrame(FutureFrame *const prev, Env *const env) : prev(prev), env(env) { }
+};
+
+static thread_local FutureFrame * t_frame = NULL;
+static thread_local unsigned t_futureDepth = 0;
+
+static void runFuture ( Future * f )
+{
+    // The frames of the current thread don't apply to the evaluation of the future
+    FutureFrame * saveFrame = t_frame;
+    t_frame = NULL;
+    ++t_futureDepth;
+    try {
+        f->value = f->call->evalCall( *f->env );
+    }
+    catch (FutureError & e) {
+        f->failed = true;
+        f->error = e.message;
+    }
+    --t_futureDepth;
+    t_frame = saveFrame;
+    f->done.store( true, std::memory_order_release );
+}
+
+/// Every worker has its own queue. New futures are pushed at the back of the queue of the
+/// current worker (or of the extra queue of the threads which aren't workers) and taken from
+/// there in LIFO order, while idle threads steal from the front of the other queues.
+class WorkPool
+{
+public:
+    explicit WorkPool ( unsigned workers ) : m_workers( workers ), m_queues( workers + 1 ), m_pending( 0 )
+    {
+        for ( unsigned i = 0; i < workers; ++i )
+            std::thread( &WorkPool::workerLoop, this, i ).detach();
+    }
+
+    void push ( Future * f )
+    {
+        Queue & q = m_queues[t_worker >= 0 ? t_worker : m_workers];
+        {
+            std::lock_guard<std::mutex> g( q.lock );
+            q.items.push_back( f );
+        }
+        ++m_pending;
+        std::lock_guard<std::mutex> g( m_idleLock );
+        m_idle.notify_one();
+    }
+
+    /// Wait for \p f to complete, evaluating other futures in the meantime.
+    void wait ( Future * f )
+    {
+        while (!f->done.load( std::memory_order_acquire )) {
+            if (Future * other = take())
+                runFuture( other );
+            else
+                std::this_thread::yield();
+        }
+    }
+
+private:
+    struct Queue
+    {
+        std::mutex lock;
+        std::deque<Future *> items;
+    };
+
+    static thread_local int t_worker;
+
+    const unsigned m_workers;
+    std::vector<Queue> m_queues;
+    std::atomic<unsigned> m_pending;
+    std::mutex m_idleLock;
+    std::condition_variable m_idle;
+
+    Future * take ()
+    {
+        if (!m_pending.load())
+            return NULL;
+        unsigned self = t_worker >= 0 ? t_worker : m_workers;
+        {
+            Queue & q = m_queues[self];
+            std::lock_guard<std::mutex> g( q.lock );
+            if (!q.items.empty()) {
+                Future * f = q.items.back();
+                q.items.pop_back();
+                --m_pending;
+                return f;
+            }
+        }
+        for ( unsigned i = 1; i <= m_workers; ++i ) {
+            Queue & q = m_queues[(self + i) % (m_workers + 1)];
+            std::lock_guard<std::mutex> g( q.lock );
+            if (!q.items.empty()) {
+                Future * f = q.items.front();
+                q.items.pop_front();
+                --m_pending;
+                return f;
+            }
+        }
+        return NULL;
+    }
+
+    void workerLoop ( unsigned index )
+    {
+        t_worker = index;
+        for(;;) {
+            if (Future * f = take())
+                runFuture( f );
+            else {
+                std::unique_lock<std::mutex> lk( m_idleLock );
+                m_idle.wait( lk, [this] { return m_pending.load() != 0; } );
+            }
+        }
+    }
+};
+
+thread_local int WorkPool::t_worker = -1;
+
+// Never destroyed, since the workers may still be running when the process exits.
+static WorkPool * s_pool = NULL;
+
+void startParallel ( unsigned threads )
+{
+    if (!s_pool)
+        s_pool = new WorkPool( threads > 1 ? threads - 1 : 0 );
+}
+
+bool inFuture ()
+{
+    return t_futureDepth != 0;
+}
+
+FutureScope::FutureScope ( Env & env, const std::vector<FunctionCall *> & calls ) :
+    frame( new FutureFrame( t_frame, &env ) )
+{
+    if (s_pool) {
+        for ( FunctionCall * call : calls ) {
+            Future * f = new Future( call, &env );
+            frame->futures.push_back( f );
+            s_pool->push( f );
+        }
+    }
+    t_frame = frame;
+}
+
+/// Futures which haven't been joined (because an error occurred, or because a native didn't
+/// evaluate all of its arguments) must still complete before the environment goes away. Their
+/// results and errors are discarded, like they would have been with serial evaluation.
+FutureScope::~FutureScope ()
+{
+    t_frame = frame->prev;
+    for ( Future * f : frame->futures ) {
+        s_pool->wait( f );
+        delete f;
+    }
+    delete frame;
+}
+
+bool joinFuture ( FunctionCall * call, Env & env, long & result )
+{
+    FutureFrame * frame = t_frame;
+    if (!frame || frame->env != &env)
+        return false;
+    for ( Future * f : frame->futures ) {
+        if (f->call == call && !f->joined) {
+            f->joined = true;
+            s_pool->wait( f );
+            if (f->failed)
+                runtimeError( "%s", f->error.c_str() );
+            result = f->value;
+            return true;
+        }
+    }
+    return false;
+}
+
+/// Finds the groups of operands and marks their expensive pure calls.
+class ParallelMarker : public AstVisitor
+{
+public:
+    unsigned count = 0;
+
+    ParallelMarker ( EffectAnalysis & effects ) : m_effects( effects ) { }
+
+    virtual void visitBinOp ( BinOp * n )
+    {
+        // Only the root of a tree of operators is a group, the rest are part of it
+        if (!m_operand) {
+            std::vector<Expr *> operands;
+            operands.push_back( n->left );
+            operands.push_back( n->right );
+            markGroup( n->parallelCalls, operands );
+        }
+        bool save = m_operand;
+        m_operand = true;
+        AstVisitor::visitBinOp( n );
+        m_operand = save;
+    }
+
+    virtual void visitFunctionCall ( FunctionCall * n )
+    {
+        std::vector<Expr *> operands;
+        for ( const auto & a : n->args )
+            operands.push_back( a.get() );
+        markGroup( n->parallelCalls, operands );
+
+        bool save = m_operand;
+        m_operand = true;
+        AstVisitor::visitFunctionCall( n );
+        m_operand = save;
+    }
+
+    virtual void visitIndex ( Index * n )
+    {
+        bool save = m_operand;
+        m_operand = false;
+        AstVisitor::visitIndex( n );
+        m_operand = save;
+    }
+
+private:
+    EffectAnalysis & m_effects;
+    /// Whether the current node is part of the group of an enclosing node
+    bool m_operand = false;
+
+    /// Whether evaluating \p n reads or writes the temporaries of the current scope, which
+    /// are not synchronized with the thread evaluating a future.
+    static bool usesTemps ( Ast * n )
+    {
+        struct Finder : public AstVisitor
+        {
+            bool found = false;
+            virtual void visitCseDef ( CseDef * ) { found = true; }
+            virtual void visitCseRef ( CseRef * ) { found = true; }
+            virtual void visitLocal ( Local * ) { found = true; }
+            virtual void visitAssignLocal ( AssignLocal * ) { found = true; }
+            virtual void visitInlinedCall ( InlinedCall * ) { found = true; }
+        } finder;
+        n->accept( finder );
+        return finder.found;
+    }
+
+    /// Calls whose arguments use temporaries are left out. The body of a future has its own.
+    static void collectCalls ( Expr * e, std::vector<FunctionCall *> & calls )
+    {
+        if (FunctionCall * call = dynamic_cast<FunctionCall *>(e)) {
+            bool temps = false;
+            for ( const auto & a : call->args )
+                temps |= usesTemps( a.get() );
+            if (!temps)
+                calls.push_back( call );
+        }
+        else if (BinOp * op = dynamic_cast<BinOp *>(e)) {
+            collectCalls( op->left, calls );
+            collectCalls( op->right, calls );
+        }
+    }
+
+    void markGroup ( std::vector<FunctionCall *> & parallelCalls, const std::vector<Expr *> & operands )
+    {
+        std::vector<FunctionCall *> calls;
+        for ( Expr * e : operands ) {
+            if (!m_effects.isPure( e ))
+                return;
+            collectCalls( e, calls );
+        }
+
+        std::vector<FunctionCall *> expensive;
+        for ( FunctionCall * call : calls ) {
+            if (m_effects.cost( call ) >= PARALLEL_MIN_COST)
+                expensive.push_back( call );
+        }
+        if (expensive.size() < 2)
+            return;
+
+        // The last one is evaluated by the current thread
+        expensive.pop_back();
+        for ( FunctionCall * call : expensive ) {
+            call->async = true;
+            parallelCalls.push_back( call );
+        }
+        count += expensive.size();
+    }
+};
+
+unsigned markParallelCalls ( Program * prog, Env & globals )
+{
+    EffectAnalysis effects( prog, globals );
+    ParallelMarker marker( effects );
+    prog->accept( marker );
+    return marker.count;
+}
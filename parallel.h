@@ -0,0 +1,39 @@
+#ifndef CALC_PARALLEL_H
+#define CALC_PARALLEL_H
+
+#include "ast.h"
+
+// Parallel evaluation of independent pure calls.
+//
+// markParallelCalls() finds groups of operands (the arguments of a call, or the operands of a
+// tree of binary operators) containing only pure code and at least two expensive calls. All
+// expensive calls of such a group except the last one are marked "async": when the group
+// starts being evaluated they are submitted as futures to a work stealing pool, and when the
+// evaluation reaches them it waits for their result instead of calling them.
+//
+// Since the futures are joined in the original order of evaluation and a runtime error in a
+// future is only reported when it is joined, the results are the same as with serial
+// evaluation.
+
+/// Calls with a lower estimated cost are always evaluated inline.
+#define PARALLEL_MIN_COST 500
+
+/// Thrown by runtimeError() while evaluating a future.
+struct FutureError
+{
+    std::string message;
+};
+
+/// Start the worker threads. \p threads is the total number of threads evaluating calls,
+/// including the current one.
+void startParallel ( unsigned threads );
+
+/// Mark the calls in \p prog which can be evaluated in parallel. Must be called before the
+/// program is evaluated. Returns the number of marked calls.
+unsigned markParallelCalls ( Program * prog, Env & globals );
+
+/// Whether the current thread is evaluating a future, in which case runtime errors must be
+/// reported to the thread joining it instead of terminating the process.
+bool inFuture ();
+
+#endif //CALC_PARALLEL_H
@@ -0,0 +1,24 @@
+#ifndef CALC_PARSER_H
+#define CALC_PARSER_H
+
+#include "ast.h"
+
+/// Parse a whole program from \p input. Syntax errors are reported and terminate the process
+/// (see ThrowErrors).
+/// If \p streamEnv is not NULL, the top level statements are evaluated in it as they are parsed,
+/// and only the return statement remains in the result.
+Program * parseFile ( FILE * input, Env * streamEnv = NULL );
+/// Parse a whole program from a string.
+Program * parseString ( const char * source );
+
+/// When enabled, the bodies of functions are only brace-matched and parsed on their first
+/// call, so syntax errors in them are not reported until then.
+void setLazyParsing ( bool lazy );
+/// Parse the bodies of all lazy functions in \p node (including nested ones), reporting any
+/// syntax errors. Returns the number of parsed bodies.
+unsigned parseAllBodies ( Ast * node );
+
+/// Register the builtin native functions (print(), the array functions, etc.) in \p env.
+void registerBuiltins ( Env & env );
+
+#endif //CALC_PARSER_H
@@ -0,0 +1,155 @@
+#include "prepared.h"
+#include "parser.h"
+#include "vecops.h"
+
+#include <thread>
+
+PreparedProgram::PreparedProgram ( const char * source, const std::vector<std::string> & inputs, bool batch ) :
+    m_prog( parseString( source ) ),
+    m_inputs( inputs ),
+    m_globals( NULL )
+{
+    registerBuiltins( m_globals );
+    for ( size_t i = 0; i < m_inputs.size(); ++i )
+        m_vars[m_inputs[i]] = newColumn( Column::Input, i );
+    if (batch)
+        compile();
+}
+
+PreparedProgram::~PreparedProgram ()
+{
+    delete m_prog;
+}
+
+unsigned PreparedProgram::newColumn ( Column::Kind kind, size_t index )
+{
+    Column c = { kind, index };
+    m_columns.push_back( c );
+    return m_columns.size() - 1;
+}
+
+/// Compile the leading statements for which that is possible. Function definitions don't
+/// depend on the inputs, so they are evaluated once here instead of for every row.
+void PreparedProgram::compile ()
+{
+    const auto & list = m_prog->body->list;
+    for ( ; m_batchStmts < list.size(); ++m_batchStmts ) {
+        Statement * stmt = list[m_batchStmts].get();
+        if (Assign * assign = dynamic_cast<Assign *>(stmt)) {
+            int reg = compileExpr( assign->value );
+            if (reg < 0)
+                break;
+            m_vars[assign->name] = reg;
+        }
+        else if (dynamic_cast<Function *>(stmt))
+            stmt->eval( m_globals );
+        else
+            break;
+    }
+    if (m_batchStmts == list.size())
+        m_returnReg = compileExpr( m_prog->returnStmt->value );
+}
+
+/// Returns the column holding the value of \p e, or -1 if it can't be compiled.
+int PreparedProgram::compileExpr ( Expr * e )
+{
+    if (Number * num = dynamic_cast<Number *>(e)) {
+        m_constants.push_back( std::vector<long>( BATCH_SIZE, num->value ) );
+        return newColumn( Column::Constant, m_constants.size() - 1 );
+    }
+    if (Ident * id = dynamic_cast<Ident *>(e)) {
+        // An undefined variable must be reported by the interpreter
+        auto it = m_vars.find( id->name );
+        return it != m_vars.end() ? (int)it->second : -1;
+    }
+    if (BinOp * op = dynamic_cast<BinOp *>(e)) {
+        size_t saveCode = m_code.size(), saveColumns = m_columns.size(), saveTemps = m_temps;
+        int a = compileExpr( op->left );
+        int b = a >= 0 ? compileExpr( op->right ) : -1;
+        if (b < 0) {
+            m_code.resize( saveCode );
+            m_columns.resize( saveColumns );
+            m_temps = saveTemps;
+            return -1;
+        }
+        Insn insn = { op->code, newColumn( Column::Temp, m_temps++ ), (unsigned)a, (unsigned)b };
+        m_code.push_back( insn );
+        return insn.dst;
+    }
+    return -1;
+}
+
+void PreparedProgram::runRows ( const long * const * columns, size_t begin, size_t end, long * output )
+{
+    std::vector<std::vector<long>> temps( m_temps, std::vector<long>( BATCH_SIZE ) );
+    std::vector<const long *> cols( m_columns.size() );
+    const auto & list = m_prog->body->list;
+
+    for ( size_t batch = begin; batch < end; batch += BATCH_SIZE ) {
+        size_t n = end - batch < BATCH_SIZE ? end - batch : BATCH_SIZE;
+
+        for ( size_t i = 0; i < m_columns.size(); ++i ) {
+            const Column & c = m_columns[i];
+            switch (c.kind) {
+                case Column::Input: cols[i] = columns[c.index] + batch; break;
+                case Column::Constant: cols[i] = m_constants[c.index].data(); break;
+                case Column::Temp: cols[i] = temps[c.index].data(); break;
+            }
+        }
+
+        for ( const Insn & insn : m_code ) {
+            long * d = temps[m_columns[insn.dst].index].data();
+            const long * a = cols[insn.a], * b = cols[insn.b];
+            switch (insn.op) {
+                case AstCode::Add: vecAdd( d, a, b, n ); break;
+                case AstCode::Sub: vecSub( d, a, b, n ); break;
+                case AstCode::Mul: vecMul( d, a, b, n ); break;
+                case AstCode::Div: vecDiv( d, a, b, n ); break;
+                case AstCode::LT: vecLess( d, a, b, n ); break;
+                case AstCode::GT: vecGreater( d, a, b, n ); break;
+                case AstCode::EQ: vecEqual( d, a, b, n ); break;
+                case AstCode::NE: vecNotEqual( d, a, b, n ); break;
+                default: assert( false );
+            }
+        }
+
+        if (m_returnReg >= 0) {
+            const long * r = cols[m_returnReg];
+            for ( size_t i = 0; i < n; ++i )
+                output[batch + i] = r[i];
+            continue;
+        }
+
+        // Evaluate the rest of the program row by row
+        for ( size_t i = 0; i < n; ++i ) {
+            Env env( &m_globals );
+            for ( const auto & v : m_vars )
+                env.vars[v.first] = cols[v.second][i];
+            for ( size_t s = m_batchStmts; s < list.size(); ++s )
+                list[s]->eval( env );
+            output[batch + i] = m_prog->returnStmt->eval( env );
+        }
+    }
+}
+
+void PreparedProgram::run ( const long * const * columns, size_t rows, long * output, unsigned threads )
+{
+    if (threads <= 1 || rows < threads * BATCH_SIZE) {
+        runRows( columns, 0, rows, output );
+        return;
+    }
+
+    // Split the rows into ranges of whole batches
+    size_t batches = (rows + BATCH_SIZE - 1) / BATCH_SIZE;
+    std::vector<std::thread> workers;
+    size_t begin = 0;
+    for ( unsigned t = 0; t < threads; ++t ) {
+        size_t end = (batches * (t + 1) / threads) * BATCH_SIZE;
+        if (end > rows)
+            end = rows;
+        workers.push_back( std::thread( &PreparedProgram::runRows, this, columns, begin, end, output ) );
+        begin = end;
+    }
+    for ( auto & w : workers )
+        w.join();
+}
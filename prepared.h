@@ -0,0 +1,69 @@
+#ifndef CALC_PREPARED_H
+#define CALC_PREPARED_H
+
+#include "ast.h"
+
+/// A program which is parsed and compiled once, and then evaluated for many rows of input
+/// values given as columns.
+///
+/// The leading straight line part of the program - assignments of arithmetic and comparisons
+/// of numbers and variables - is compiled into operations on columns, which are executed for
+/// batches of rows at a time. The rest of the program, starting with the first statement which
+/// can't be compiled (an if, a loop, a call, etc.), is evaluated by the interpreter separately
+/// for every row, starting with the variables computed by the batch part.
+class PreparedProgram
+{
+public:
+    /// Number of rows processed at a time by the batch part.
+    static const size_t BATCH_SIZE = 512;
+
+    /// Parse and compile \p source. The variables named by \p inputs are defined at the top
+    /// level scope when the program runs. If \p batch is false everything is evaluated by the
+    /// interpreter row by row.
+    PreparedProgram ( const char * source, const std::vector<std::string> & inputs, bool batch = true );
+    ~PreparedProgram ();
+
+    /// Evaluate the program for \p rows rows, storing the values it returns in \p output.
+    /// \p columns[i][row] is the value of the i-th input variable. The rows are split between
+    /// \p threads threads.
+    void run ( const long * const * columns, size_t rows, long * output, unsigned threads = 1 );
+
+    /// Number of top level statements executed in batches.
+    size_t batchStatements () const { return m_batchStmts; }
+    /// Whether the returned value is computed in batches too.
+    bool batchReturn () const { return m_returnReg >= 0; }
+
+private:
+    /// Operands of the batch operations are columns: either the rows of an input, the same
+    /// constant in every row, or a temporary.
+    struct Column
+    {
+        enum Kind { Input, Constant, Temp } kind;
+        size_t index;
+    };
+    struct Insn
+    {
+        AstCode::T op;
+        unsigned dst, a, b;
+    };
+
+    Program * const m_prog;
+    const std::vector<std::string> m_inputs;
+    Env m_globals;
+
+    std::vector<Column> m_columns;
+    std::vector<std::vector<long>> m_constants;
+    size_t m_temps = 0;
+    std::vector<Insn> m_code;
+    /// The column holding the current value of every variable assigned by the batch part.
+    std::map<std::string, unsigned> m_vars;
+    size_t m_batchStmts = 0;
+    int m_returnReg = -1;
+
+    void compile ();
+    int compileExpr ( Expr * e );
+    unsigned newColumn ( Column::Kind kind, size_t index );
+    void runRows ( const long * const * columns, size_t begin, size_t end, long * output );
+};
+
+#endif //CALC_PREPARED_H
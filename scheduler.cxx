@@ -0,0 +1,173 @@
+#include "scheduler.h"
+
+#include <poll.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+thread_local Scheduler * Scheduler::s_current = NULL;
+
+static long nowMs ()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+Scheduler::Scheduler ( size_t stackSize ) :
+    m_stackSize( stackSize < MIN_STACK_SIZE ? MIN_STACK_SIZE : stackSize ),
+    m_pageSize( sysconf( _SC_PAGESIZE ) )
+{ }
+
+Scheduler::~Scheduler ()
+{
+    for ( Task * t : m_tasks ) {
+        if (t->stack)
+            m_freeStacks.push_back( t->stack );
+        delete t;
+    }
+    for ( char * s : m_freeStacks )
+        munmap( s, m_stackSize + m_pageSize );
+}
+
+/// Stacks have an inaccessible guard page at the bottom, so an overflow crashes instead of
+/// silently corrupting the neighbouring stack.
+char * Scheduler::allocStack ()
+{
+    if (!m_freeStacks.empty()) {
+        char * s = m_freeStacks.back();
+        m_freeStacks.pop_back();
+        return s;
+    }
+    void * p = mmap( NULL, m_stackSize + m_pageSize, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0 );
+    if (p == MAP_FAILED)
+        runtimeError( "Cannot allocate a task stack" );
+    mprotect( p, m_pageSize, PROT_NONE );
+    return (char *)p;
+}
+
+Task * Scheduler::spawn ( Program * prog, Env * env )
+{
+    Task * task = new Task( prog, env );
+    m_tasks.push_back( task );
+    m_ready.push_back( task );
+    return task;
+}
+
+void Scheduler::taskEntry ()
+{
+    Scheduler * sched = s_current;
+    Task * task = sched->m_running;
+    task->result = task->prog->eval( *task->env );
+    task->done = true;
+    // Returning resumes uc_link, which is the scheduler context.
+}
+
+void Scheduler::resume ( Task * task )
+{
+    if (!task->stack) {
+        task->stack = allocStack();
+        getcontext( &task->ctx );
+        task->ctx.uc_stack.ss_sp = task->stack + m_pageSize;
+        task->ctx.uc_stack.ss_size = m_stackSize;
+        task->ctx.uc_link = &m_schedCtx;
+        makecontext( &task->ctx, taskEntry, 0 );
+    }
+
+    m_running = task;
+    s_current = this;
+    swapcontext( &m_schedCtx, &task->ctx );
+    s_current = NULL;
+    m_running = NULL;
+
+    if (task->done) {
+        m_freeStacks.push_back( task->stack );
+        task->stack = NULL;
+    }
+}
+
+void Scheduler::suspend ()
+{
+    swapcontext( &m_running->ctx, &m_schedCtx );
+}
+
+void Scheduler::sleep ( long ms )
+{
+    Timer t = { nowMs() + (ms > 0 ? ms : 0), m_timerSeq++, m_running };
+    m_timers.push( t );
+    suspend();
+}
+
+void Scheduler::waitReadable ( int fd )
+{
+    m_running->waitFd = fd;
+    m_fdWaiters.push_back( m_running );
+    suspend();
+}
+
+/// Wait until at least one suspended task can continue and move it to the ready queue.
+void Scheduler::poll ()
+{
+    int timeout = -1;
+    if (!m_timers.empty()) {
+        long delta = m_timers.top().wakeTime - nowMs();
+        timeout = delta > 0 ? (int)delta : 0;
+    }
+
+    if (!m_fdWaiters.empty() || timeout > 0) {
+        std::vector<struct pollfd> fds( m_fdWaiters.size() );
+        for ( size_t i = 0; i < fds.size(); ++i ) {
+            fds[i].fd = m_fdWaiters[i]->waitFd;
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+        if (::poll( fds.data(), fds.size(), timeout ) > 0) {
+            size_t j = 0;
+            for ( size_t i = 0; i < fds.size(); ++i ) {
+                Task * t = m_fdWaiters[i];
+                if (fds[i].revents) {
+                    t->waitFd = -1;
+                    m_ready.push_back( t );
+                }
+                else
+                    m_fdWaiters[j++] = t;
+            }
+            m_fdWaiters.resize( j );
+        }
+    }
+
+    long now = nowMs();
+    while (!m_timers.empty() && m_timers.top().wakeTime <= now) {
+        m_ready.push_back( m_timers.top().task );
+        m_timers.pop();
+    }
+}
+
+bool Scheduler::stackExhausted () const
+{
+    char probe;
+    // Stacks grow down, towards the guard page
+    return (size_t)(&probe - (m_running->stack + m_pageSize)) < STACK_RESERVE;
+}
+
+void checkTaskStack ()
+{
+    Scheduler * sched = Scheduler::current();
+    if (sched && sched->stackExhausted())
+        runtimeError( "Stack overflow in task" );
+}
+
+void Scheduler::run ()
+{
+    for(;;) {
+        while (!m_ready.empty()) {
+            Task * t = m_ready.front();
+            m_ready.pop_front();
+            resume( t );
+        }
+        if (m_timers.empty() && m_fdWaiters.empty())
+            break;
+        poll();
+    }
+}
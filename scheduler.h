@@ -0,0 +1,96 @@
+#ifndef CALC_SCHEDULER_H
+#define CALC_SCHEDULER_H
+
+#include <ucontext.h>
+#include <deque>
+#include <queue>
+#include <vector>
+
+#include "ast.h"
+
+/// A script execution with its own stack, so that it can be suspended in the middle of a
+/// native call and resumed later.
+struct Task
+{
+    Program * const prog;
+    Env * const env;
+    long result = 0;
+    bool done = false;
+
+    ucontext_t ctx;
+    char * stack = NULL;
+    int waitFd = -1;
+
+    Task(Program *const prog, Env *const env) : prog(prog), env(env) { }
+};
+
+/// A single threaded cooperative scheduler multiplexing many script executions. Native
+/// functions which would otherwise block call sleep() or waitReadable(), which suspends the
+/// calling script and lets the others run in the meantime.
+///
+/// Stacks are reserved with mmap() and only the pages actually touched by a script consume
+/// memory, so each suspended script costs little more than the depth of its recursion. Calls
+/// report a runtime error instead of overflowing the stack (see checkTaskStack()).
+class Scheduler
+{
+public:
+    /// The default size of the stack of a task.
+    static const size_t DEFAULT_STACK_SIZE = 8 * 1024 * 1024;
+    /// Stack space kept free below the deepest call, for the evaluation of its body and natives.
+    static const size_t STACK_RESERVE = 64 * 1024;
+    /// The smallest usable stack size.
+    static const size_t MIN_STACK_SIZE = 2 * STACK_RESERVE;
+
+    explicit Scheduler ( size_t stackSize = DEFAULT_STACK_SIZE );
+    ~Scheduler ();
+
+    /// Create a task evaluating \p prog in \p env. It starts running in run().
+    Task * spawn ( Program * prog, Env * env );
+    /// Run until all tasks have completed.
+    void run ();
+
+    /// The scheduler of the currently running task, or NULL when not called from a task.
+    static Scheduler * current () { return s_current; }
+
+    /// Suspend the current task for \p ms milliseconds.
+    void sleep ( long ms );
+    /// Suspend the current task until \p fd becomes readable.
+    void waitReadable ( int fd );
+
+    /// Whether the current task has less than STACK_RESERVE bytes of stack left.
+    bool stackExhausted () const;
+
+private:
+    struct Timer
+    {
+        long wakeTime;
+        unsigned long seq; // keeps the order of timers expiring at the same time
+        Task * task;
+
+        bool operator< ( const Timer & o ) const
+        {
+            return wakeTime > o.wakeTime || (wakeTime == o.wakeTime && seq > o.seq);
+        }
+    };
+
+    static thread_local Scheduler * s_current;
+
+    const size_t m_stackSize;
+    const size_t m_pageSize;
+    std::vector<Task *> m_tasks;
+    std::deque<Task *> m_ready;
+    std::priority_queue<Timer> m_timers;
+    unsigned long m_timerSeq = 0;
+    std::vector<Task *> m_fdWaiters;
+    std::vector<char *> m_freeStacks;
+    Task * m_running = NULL;
+    ucontext_t m_schedCtx;
+
+    static void taskEntry ();
+    void resume ( Task * task );
+    void suspend ();
+    void poll ();
+    char * allocStack ();
+};
+
+#endif //CALC_SCHEDULER_H
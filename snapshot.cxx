@@ -0,0 +1,553 @@
+#include "snapshot.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// The file starts with a header describing the sections, which are arrays of the records below.
+// Nodes refer to their children by index in the node section. A child always precedes its parent
+// and the nodes of a tree are contiguous, so a tree can be created in order. Variable length
+// lists of children (arguments, statements, parameters) are ranges of the list section. Strings
+// are stored once each in the string section, preceded by their length.
+
+static_assert( sizeof(long) == sizeof(int64_t), "values are saved as 64-bit" );
+
+namespace {
+
+const char SNAPSHOT_MAGIC[8] = { 'C', 'A', 'L', 'C', 'S', 'N', 'A', 'P' };
+const uint32_t SNAPSHOT_VERSION = 1;
+/// A missing child.
+const uint32_t NONE = 0xFFFFFFFF;
+
+struct Section
+{
+    uint64_t offset, count;
+};
+
+struct Header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t size;
+    Section vars, arrays, funcs, nodes, lists, data, strings;
+};
+
+struct VarRec
+{
+    uint32_t name;
+    uint32_t reserved;
+    int64_t value;
+};
+
+struct ArrayRec
+{
+    uint32_t name;
+    uint32_t reserved;
+    /// Range of the data section.
+    uint64_t data, size;
+};
+
+enum Kind : uint32_t
+{
+    KNumber, KIdent, KIndex, KCall, KBinOp, KReturn, KIf, KWhile, KAssign, KAssignIndex, KBlock,
+    KStatementExpr, KProgram, KFunction, KLazyFunction
+};
+
+struct NodeRec
+{
+    uint32_t kind;
+    uint32_t name;
+    /// For a function, the root and the first node of the tree of its body.
+    uint32_t child[3];
+    /// Range of the list section.
+    uint32_t list, count;
+    /// Position of the body of a lazy function.
+    int32_t line, col;
+    uint32_t reserved;
+    /// A number, the operator of a BinOp, or the source of a lazy function.
+    int64_t value;
+};
+
+/// The operators are saved as characters, so the file doesn't depend on the order of AstCode.
+const struct { AstCode::T code; char op; } s_ops[] = {
+    { AstCode::Mul, '*' }, { AstCode::Div, '/' }, { AstCode::Add, '+' }, { AstCode::Sub, '-' },
+    { AstCode::LT, '<' }, { AstCode::GT, '>' }, { AstCode::EQ, '=' }, { AstCode::NE, '!' },
+};
+
+class Writer : public AstVisitor
+{
+public:
+    std::vector<VarRec> vars;
+    std::vector<ArrayRec> arrays;
+    std::vector<uint32_t> funcs;
+    std::vector<NodeRec> nodes;
+    std::vector<uint32_t> lists;
+    std::vector<int64_t> data;
+    std::string strings;
+
+    uint32_t str ( const std::string & s )
+    {
+        auto it = m_strings.find( s );
+        if (it != m_strings.end())
+            return it->second;
+        uint32_t off = strings.size();
+        uint32_t len = s.size();
+        strings.append( (const char *)&len, sizeof(len) );
+        strings.append( s.c_str(), len + 1 );
+        return m_strings[s] = off;
+    }
+
+    /// Save \p n and its children, returning its index.
+    uint32_t node ( Ast * n )
+    {
+        if (!n)
+            return NONE;
+        n->accept( *this );
+        return m_last;
+    }
+
+    virtual void visitNumber ( Number * n )
+    {
+        NodeRec r = rec( KNumber );
+        r.value = n->value;
+        add( r );
+    }
+    virtual void visitIdent ( Ident * n )
+    {
+        NodeRec r = rec( KIdent );
+        r.name = str( n->name );
+        add( r );
+    }
+    virtual void visitIndex ( Index * n )
+    {
+        NodeRec r = rec( KIndex );
+        r.name = str( n->name );
+        r.child[0] = node( n->index );
+        add( r );
+    }
+    virtual void visitBinOp ( BinOp * n )
+    {
+        NodeRec r = rec( KBinOp );
+        r.child[0] = node( n->left );
+        r.child[1] = node( n->right );
+        for ( const auto & o : s_ops ) {
+            if (o.code == n->code)
+                r.value = o.op;
+        }
+        add( r );
+    }
+    virtual void visitFunctionCall ( FunctionCall * n )
+    {
+        std::vector<uint32_t> args;
+        for ( const auto & a : n->args )
+            args.push_back( node( a.get() ) );
+        NodeRec r = rec( KCall );
+        r.name = str( n->name );
+        setList( r, args );
+        add( r );
+    }
+    virtual void visitReturn ( Return * n )
+    {
+        NodeRec r = rec( KReturn );
+        r.child[0] = node( n->value );
+        add( r );
+    }
+    virtual void visitStatementExpr ( StatementExpr * n )
+    {
+        NodeRec r = rec( KStatementExpr );
+        r.child[0] = node( n->expr );
+        add( r );
+    }
+    virtual void visitIf ( If * n )
+    {
+        NodeRec r = rec( KIf );
+        r.child[0] = node( n->cond );
+        r.child[1] = node( n->thenClause );
+        r.child[2] = node( n->elseClause );
+        add( r );
+    }
+    virtual void visitWhile ( While * n )
+    {
+        NodeRec r = rec( KWhile );
+        r.child[0] = node( n->cond );
+        r.child[1] = node( n->body );
+        add( r );
+    }
+    virtual void visitAssign ( Assign * n )
+    {
+        NodeRec r = rec( KAssign );
+        r.name = str( n->name );
+        r.child[0] = node( n->value );
+        add( r );
+    }
+    virtual void visitAssignIndex ( AssignIndex * n )
+    {
+        NodeRec r = rec( KAssignIndex );
+        r.name = str( n->name );
+        r.child[0] = node( n->index );
+        r.child[1] = node( n->value );
+        add( r );
+    }
+    virtual void visitBlock ( Block * n )
+    {
+        std::vector<uint32_t> stmts;
+        for ( const auto & sp : n->list )
+            stmts.push_back( node( sp.get() ) );
+        NodeRec r = rec( KBlock );
+        setList( r, stmts );
+        add( r );
+    }
+    virtual void visitProgram ( Program * n )
+    {
+        NodeRec r = rec( KProgram );
+        r.child[0] = node( n->body );
+        r.child[1] = node( n->returnStmt );
+        add( r );
+    }
+    virtual void visitFunction ( Function * n )
+    {
+        std::vector<uint32_t> params;
+        for ( const auto & p : n->params )
+            params.push_back( str( p ) );
+        // A function restored from a snapshot is saved again
+        if (n->bodyLoader)
+            n->parseBody();
+        NodeRec r = rec( n->body ? KFunction : KLazyFunction );
+        r.name = str( n->name );
+        setList( r, params );
+        if (n->body) {
+            r.child[1] = nodes.size();
+            r.child[0] = node( n->body );
+        }
+        else {
+            r.value = str( n->bodySource );
+            r.line = n->bodyLine;
+            r.col = n->bodyCol;
+        }
+        add( r );
+    }
+
+    virtual void visitCseDef ( CseDef * ) { optimized(); }
+    virtual void visitCseRef ( CseRef * ) { optimized(); }
+    virtual void visitLocal ( Local * ) { optimized(); }
+    virtual void visitAssignLocal ( AssignLocal * ) { optimized(); }
+    virtual void visitInlinedCall ( InlinedCall * ) { optimized(); }
+
+private:
+    std::map<std::string, uint32_t> m_strings;
+    uint32_t m_last = NONE;
+
+    static NodeRec rec ( Kind kind )
+    {
+        NodeRec r;
+        memset( &r, 0, sizeof(r) );
+        r.kind = kind;
+        r.child[0] = r.child[1] = r.child[2] = NONE;
+        return r;
+    }
+    void add ( const NodeRec & r )
+    {
+        nodes.push_back( r );
+        m_last = nodes.size() - 1;
+    }
+    void setList ( NodeRec & r, const std::vector<uint32_t> & items )
+    {
+        r.list = lists.size();
+        r.count = items.size();
+        lists.insert( lists.end(), items.begin(), items.end() );
+    }
+    static void optimized ()
+    {
+        fprintf( stderr, "Optimized functions can't be saved in a snapshot\n" );
+        exit( 1 );
+    }
+};
+
+/// Append the contents of \p v to \p out as a section aligned to 8 bytes.
+template <class T>
+Section appendSection ( std::string & out, const std::vector<T> & v )
+{
+    out.resize( (out.size() + 7) & ~(size_t)7 );
+    Section s = { out.size(), v.size() };
+    out.append( (const char *)v.data(), v.size() * sizeof(T) );
+    return s;
+}
+
+/// Creates the contents of a mapped snapshot. The bodies of the global functions are only
+/// created when they are first called, so the mapping is kept as long as any of them may be.
+class Reader
+{
+public:
+    Reader ( const char * path, const char * base, size_t size ) : m_path(path), m_base(base), m_size(size)
+    {
+        if (size < sizeof(Header))
+            invalid();
+        m_header = (const Header *)base;
+        if (memcmp( m_header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC) ) != 0 ||
+            m_header->version != SNAPSHOT_VERSION || m_header->size != size)
+            invalid();
+        m_nodes = section<NodeRec>( m_header->nodes );
+        m_lists = section<uint32_t>( m_header->lists );
+        m_strings = section<char>( m_header->strings );
+    }
+    ~Reader ()
+    {
+        munmap( (void *)m_base, m_size );
+    }
+
+    static void load ( const std::shared_ptr<Reader> & self, Env & env )
+    {
+        Reader & r = *self;
+        const VarRec * vars = r.section<VarRec>( r.m_header->vars );
+        for ( uint64_t i = 0; i < r.m_header->vars.count; ++i )
+            env.vars[r.str( vars[i].name )] = vars[i].value;
+
+        const ArrayRec * arrays = r.section<ArrayRec>( r.m_header->arrays );
+        const int64_t * data = r.section<int64_t>( r.m_header->data );
+        for ( uint64_t i = 0; i < r.m_header->arrays.count; ++i ) {
+            const ArrayRec & a = arrays[i];
+            if (a.data > r.m_header->data.count || a.size > r.m_header->data.count - a.data)
+                r.invalid();
+            ArrayPtr p( new Array( a.size ) );
+            memcpy( p->data.data(), data + a.data, a.size * sizeof(long) );
+            env.arrays[r.str( a.name )] = p;
+        }
+
+        const uint32_t * funcs = r.section<uint32_t>( r.m_header->funcs );
+        for ( uint64_t i = 0; i < r.m_header->funcs.count; ++i ) {
+            if (funcs[i] >= r.m_header->nodes.count)
+                r.invalid();
+            const NodeRec & rec = r.m_nodes[funcs[i]];
+            Function * f;
+            if (rec.kind == KLazyFunction)
+                f = r.lazyFunction( rec );
+            else if (rec.kind == KFunction) {
+                uint32_t first = rec.child[1], last = rec.child[0];
+                if (first > last || last >= funcs[i])
+                    r.invalid();
+                f = new Function( r.str( rec.name ), r.params( rec ), [self, first, last]() {
+                    return self->build<Program>( first, last );
+                } );
+            }
+            else
+                r.invalid();
+            env.funcs[f->name] = f;
+        }
+    }
+
+private:
+    const std::string m_path;
+    const char * const m_base;
+    const size_t m_size;
+    const Header * m_header;
+    const NodeRec * m_nodes;
+    const uint32_t * m_lists;
+    const char * m_strings;
+
+    void invalid ()
+    {
+        fprintf( stderr, "%s: invalid snapshot\n", m_path.c_str() );
+        exit( 1 );
+    }
+
+    template <class T>
+    const T * section ( const Section & s )
+    {
+        if (s.offset % alignof(T) || s.offset > m_size || s.count > (m_size - s.offset) / sizeof(T))
+            invalid();
+        return (const T *)(m_base + s.offset);
+    }
+
+    std::string str ( uint64_t off )
+    {
+        uint32_t len;
+        if (off > m_header->strings.count || m_header->strings.count - off < sizeof(len))
+            invalid();
+        memcpy( &len, m_strings + off, sizeof(len) );
+        if (m_header->strings.count - off - sizeof(len) <= len)
+            invalid();
+        return std::string( m_strings + off + sizeof(len), len );
+    }
+
+    const uint32_t * list ( const NodeRec & r )
+    {
+        if (r.list > m_header->lists.count || r.count > m_header->lists.count - r.list)
+            invalid();
+        return m_lists + r.list;
+    }
+
+    std::vector<std::string> params ( const NodeRec & r )
+    {
+        const uint32_t * items = list( r );
+        std::vector<std::string> res;
+        for ( uint32_t j = 0; j < r.count; ++j )
+            res.push_back( str( items[j] ) );
+        return res;
+    }
+
+    Function * lazyFunction ( const NodeRec & r )
+    {
+        return new Function( str( r.name ), params( r ), str( r.value ), r.line, r.col );
+    }
+
+    /// The nodes of a tree being created.
+    struct Tree
+    {
+        uint64_t first;
+        std::vector<Ast *> built;
+        std::vector<bool> used;
+    };
+
+    /// The node \p index, which must be a child of node \p parent of \p tree (so it has already
+    /// been created) and mustn't have another parent.
+    template <class T>
+    T * child ( Tree & tree, uint64_t parent, uint32_t index, bool optional = false )
+    {
+        if (index == NONE && optional)
+            return NULL;
+        if (index < tree.first || index >= parent || tree.used[index - tree.first])
+            invalid();
+        tree.used[index - tree.first] = true;
+        T * res = dynamic_cast<T *>(tree.built[index - tree.first]);
+        if (!res)
+            invalid();
+        return res;
+    }
+
+    /// Create the tree of nodes \p first to \p last, whose root is the last one.
+    template <class T>
+    T * build ( uint64_t first, uint64_t last )
+    {
+        Tree tree;
+        tree.first = first;
+        tree.used.resize( last - first + 1 );
+        for ( uint64_t i = first; i <= last; ++i )
+            tree.built.push_back( build( tree, i ) );
+        for ( uint64_t i = first; i < last; ++i ) {
+            if (!tree.used[i - first])
+                invalid();
+        }
+        T * res = dynamic_cast<T *>(tree.built.back());
+        if (!res)
+            invalid();
+        return res;
+    }
+
+    Ast * build ( Tree & t, uint64_t i )
+    {
+        const NodeRec & r = m_nodes[i];
+        switch (r.kind) {
+            case KNumber:
+                return new Number( r.value );
+            case KIdent:
+                return new Ident( str( r.name ) );
+            case KIndex:
+                return new Index( str( r.name ), child<Expr>( t, i, r.child[0] ) );
+            case KCall: {
+                const uint32_t * items = list( r );
+                std::vector<ExprPtr> args;
+                for ( uint32_t j = 0; j < r.count; ++j )
+                    args.push_back( ExprPtr( child<Expr>( t, i, items[j] ) ) );
+                return new FunctionCall( str( r.name ), std::move( args ) );
+            }
+            case KBinOp:
+                for ( const auto & o : s_ops ) {
+                    if (o.op == r.value)
+                        return new BinOp( o.code, child<Expr>( t, i, r.child[0] ), child<Expr>( t, i, r.child[1] ) );
+                }
+                break;
+            case KReturn:
+                return new Return( child<Expr>( t, i, r.child[0] ) );
+            case KIf:
+                return new If( child<Expr>( t, i, r.child[0] ), child<Statement>( t, i, r.child[1], true ),
+                               child<Statement>( t, i, r.child[2], true ) );
+            case KWhile:
+                return new While( child<Expr>( t, i, r.child[0] ), child<Statement>( t, i, r.child[1], true ) );
+            case KAssign:
+                return new Assign( str( r.name ), child<Expr>( t, i, r.child[0] ) );
+            case KAssignIndex:
+                return new AssignIndex( str( r.name ), child<Expr>( t, i, r.child[0] ), child<Expr>( t, i, r.child[1] ) );
+            case KBlock: {
+                const uint32_t * items = list( r );
+                std::vector<StatementPtr> stmts;
+                for ( uint32_t j = 0; j < r.count; ++j )
+                    stmts.push_back( StatementPtr( child<Statement>( t, i, items[j] ) ) );
+                return new Block( std::move( stmts ) );
+            }
+            case KStatementExpr:
+                return new StatementExpr( child<Expr>( t, i, r.child[0] ) );
+            case KProgram:
+                return new Program( child<Block>( t, i, r.child[0] ), child<Return>( t, i, r.child[1] ) );
+            case KFunction:
+                return new Function( str( r.name ), params( r ), child<Program>( t, i, r.child[0] ) );
+            case KLazyFunction:
+                return lazyFunction( r );
+        }
+        invalid();
+        return NULL;
+    }
+};
+
+}
+
+void saveSnapshot ( const char * path, Env & env )
+{
+    Writer w;
+    for ( const auto & v : env.vars ) {
+        VarRec r = { w.str( v.first ), 0, v.second };
+        w.vars.push_back( r );
+    }
+    for ( const auto & a : env.arrays ) {
+        ArrayRec r = { w.str( a.first ), 0, w.data.size(), a.second->data.size() };
+        w.arrays.push_back( r );
+        w.data.insert( w.data.end(), a.second->data.begin(), a.second->data.end() );
+    }
+    for ( const auto & f : env.funcs ) {
+        if (!dynamic_cast<NativeFunction *>(f.second))
+            w.funcs.push_back( w.node( f.second ) );
+    }
+
+    Header h;
+    memset( &h, 0, sizeof(h) );
+    std::string out( sizeof(h), '\0' );
+    h.vars = appendSection( out, w.vars );
+    h.arrays = appendSection( out, w.arrays );
+    h.funcs = appendSection( out, w.funcs );
+    h.nodes = appendSection( out, w.nodes );
+    h.lists = appendSection( out, w.lists );
+    h.data = appendSection( out, w.data );
+    h.strings = appendSection( out, std::vector<char>( w.strings.begin(), w.strings.end() ) );
+    memcpy( h.magic, SNAPSHOT_MAGIC, sizeof(h.magic) );
+    h.version = SNAPSHOT_VERSION;
+    h.size = out.size();
+    memcpy( &out[0], &h, sizeof(h) );
+
+    FILE * f = fopen( path, "wb" );
+    if (!f || fwrite( out.data(), 1, out.size(), f ) != out.size() || fclose( f ) != 0) {
+        perror( path );
+        exit( 1 );
+    }
+}
+
+void loadSnapshot ( const char * path, Env & env )
+{
+    int fd = open( path, O_RDONLY );
+    struct stat st;
+    if (fd < 0 || fstat( fd, &st ) < 0) {
+        perror( path );
+        exit( 1 );
+    }
+    size_t size = st.st_size;
+    void * base = size ? mmap( NULL, size, PROT_READ, MAP_PRIVATE, fd, 0 ) : MAP_FAILED;
+    close( fd );
+    if (base == MAP_FAILED) {
+        fprintf( stderr, "%s: invalid snapshot\n", path );
+        exit( 1 );
+    }
+    Reader::load( std::make_shared<Reader>( path, (const char *)base, size ), env );
+}
@@ -0,0 +1,28 @@
+#ifndef CALC_SNAPSHOT_H
+#define CALC_SNAPSHOT_H
+
+#include "ast.h"
+
+/// Snapshots of the global scope, so that a prelude defining functions and constants can be
+/// run once and its results loaded quickly by later runs.
+///
+/// A snapshot contains the variables, arrays and script functions (with their ASTs) defined
+/// directly in a scope. Natives are not saved; they are expected to be registered by the
+/// process loading it. The file contains no pointers, only offsets from its start, and is
+/// mapped into memory when loaded. The functions are defined right away, but the nodes of
+/// their bodies are only created from the mapping on their first call, in a single pass and
+/// without parsing anything. Lazy functions which haven't been parsed yet are saved as source
+/// text and remain lazy.
+///
+/// The format depends on the byte order and is checked by the magic and version in the header.
+/// Errors are reported on stderr and terminate the process.
+
+/// Write the contents of \p env to the file \p path. Optimized ASTs (after CSE or inlining)
+/// can't be saved.
+void saveSnapshot ( const char * path, Env & env );
+
+/// Define the contents of the snapshot file \p path in \p env, replacing existing definitions
+/// with the same names.
+void loadSnapshot ( const char * path, Env & env );
+
+#endif //CALC_SNAPSHOT_H
@@ -0,0 +1,119 @@
+#include "vecops.h"
+
+// The arithmetic is done in unsigned longs, so that overflow wraps around instead of being
+// undefined behavior, which would otherwise allow the compiler to assume it never happens.
+
+long vecSum ( const long * a, size_t n )
+{
+    unsigned long s = 0;
+    for ( size_t i = 0; i < n; ++i )
+        s += (unsigned long)a[i];
+    return (long)s;
+}
+
+long vecMin ( const long * a, size_t n )
+{
+    long m = a[0];
+    for ( size_t i = 1; i < n; ++i )
+        m = a[i] < m ? a[i] : m;
+    return m;
+}
+
+long vecMax ( const long * a, size_t n )
+{
+    long m = a[0];
+    for ( size_t i = 1; i < n; ++i )
+        m = a[i] > m ? a[i] : m;
+    return m;
+}
+
+long vecDot ( const long * a, const long * b, size_t n )
+{
+    unsigned long s = 0;
+    for ( size_t i = 0; i < n; ++i )
+        s += (unsigned long)a[i] * (unsigned long)b[i];
+    return (long)s;
+}
+
+void vecAdd ( long * d, const long * a, const long * b, size_t n )
+{
+    for ( size_t i = 0; i < n; ++i )
+        d[i] = (long)((unsigned long)a[i] + (unsigned long)b[i]);
+}
+
+void vecSub ( long * d, const long * a, const long * b, size_t n )
+{
+    for ( size_t i = 0; i < n; ++i )
+        d[i] = (long)((unsigned long)a[i] - (unsigned long)b[i]);
+}
+
+void vecMul ( long * d, const long * a, const long * b, size_t n )
+{
+    for ( size_t i = 0; i < n; ++i )
+        d[i] = (long)((unsigned long)a[i] * (unsigned long)b[i]);
+}
+
+void vecDiv ( long * d, const long * a, const long * b, size_t n )
+{
+    for ( size_t i = 0; i < n; ++i )
+        d[i] = a[i] / b[i];
+}
+
+void vecLess ( long * d, const long * a, const long * b, size_t n )
+{
+    for ( size_t i = 0; i < n; ++i )
+        d[i] = a[i] < b[i];
+}
+
+void vecGreater ( long * d, const long * a, const long * b, size_t n )
+{
+    for ( size_t i = 0; i < n; ++i )
+        d[i] = a[i] > b[i];
+}
+
+void vecEqual ( long * d, const long * a, const long * b, size_t n )
+{
+    for ( size_t i = 0; i < n; ++i )
+        d[i] = a[i] == b[i];
+}
+
+void vecNotEqual ( long * d, const long * a, const long * b, size_t n )
+{
+    for ( size_t i = 0; i < n; ++i )
+        d[i] = a[i] != b[i];
+}
+
+void vecAddScalar ( long * d, const long * a, long s, size_t n )
+{
+    for ( size_t i = 0; i < n; ++i )
+        d[i] = (long)((unsigned long)a[i] + (unsigned long)s);
+}
+
+void vecMulScalar ( long * d, const long * a, long s, size_t n )
+{
+    for ( size_t i = 0; i < n; ++i )
+        d[i] = (long)((unsigned long)a[i] * (unsigned long)s);
+}
+
+void vecFill ( long * d, long s, size_t n )
+{
+    for ( size_t i = 0; i < n; ++i )
+        d[i] = s;
+}
+
+// A prefix sum is inherently sequential, but only through the running total. Processing the
+// input in independent pairs halves the length of the dependency chain.
+void vecPrefixSum ( long * d, const long * a, size_t n )
+{
+    unsigned long s = 0;
+    size_t i = 0;
+    for ( ; i + 2 <= n; i += 2 ) {
+        unsigned long a0 = (unsigned long)a[i];
+        unsigned long a01 = a0 + (unsigned long)a[i+1];
+        d[i] = (long)(s + a0);
+        d[i+1] = (long)(s + a01);
+        s += a01;
+    }
+    if (i < n)
+        d[i] = (long)(s + (unsigned long)a[i]);
+}
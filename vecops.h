@@ -0,0 +1,33 @@
+#ifndef CALC_VECOPS_H
+#define CALC_VECOPS_H
+
+#include <stddef.h>
+
+// Bulk operations over contiguous arrays of values, used to implement the array builtins.
+// They are written as simple loops over raw pointers, without calls or data-dependent
+// branches, so that the compiler turns them into SIMD code (see CALC_NATIVE_ARCH in
+// CMakeLists.txt for enabling the wider instruction sets of the host CPU).
+
+long vecSum ( const long * a, size_t n );
+/// \pre n > 0
+long vecMin ( const long * a, size_t n );
+/// \pre n > 0
+long vecMax ( const long * a, size_t n );
+long vecDot ( const long * a, const long * b, size_t n );
+
+// The destination of the elementwise operations may be the same array as one of the sources.
+void vecAdd ( long * d, const long * a, const long * b, size_t n );
+void vecSub ( long * d, const long * a, const long * b, size_t n );
+void vecMul ( long * d, const long * a, const long * b, size_t n );
+void vecDiv ( long * d, const long * a, const long * b, size_t n );
+// Comparisons store 1 for true and 0 for false, like the language operators.
+void vecLess ( long * d, const long * a, const long * b, size_t n );
+void vecGreater ( long * d, const long * a, const long * b, size_t n );
+void vecEqual ( long * d, const long * a, const long * b, size_t n );
+void vecNotEqual ( long * d, const long * a, const long * b, size_t n );
+void vecAddScalar ( long * d, const long * a, long s, size_t n );
+void vecMulScalar ( long * d, const long * a, long s, size_t n );
+void vecFill ( long * d, long s, size_t n );
+void vecPrefixSum ( long * d, const long * a, size_t n );
+
+#endif //CALC_VECOPS_H